@@ -38,5 +38,7 @@ setup(
         "Programming Language :: C"],
     ext_modules = [
         Extension("pyv4l2", [path.join("src", "v4l2_wrapper.c")],
-        libraries=["v4l2"], extra_compile_args=['-DUSE_LIBV4L', ],
+        libraries=["v4l2", "jpeg", "png"],
+        extra_compile_args=['-DUSE_LIBV4L', '-DUSE_LIBJPEG', '-DUSE_LIBPNG',
+                            '-O3', ],
         )])
@@ -22,14 +22,52 @@
 
 #include <Python.h>
 #include <structmember.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <linux/netlink.h>
 #include <linux/videodev2.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+/* SSSE3 kernels are built whatever -m flags and picked at run time */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#  include <tmmintrin.h>
+#  define HAVE_SSSE3_KERNELS
+#endif
+#ifdef __ARM_NEON
+#  include <arm_neon.h>
+#endif
+
+#ifdef USE_LIBJPEG
+#  include <setjmp.h>
+#  include <jpeglib.h>
+#endif
+#ifdef USE_LIBPNG
+#  include <png.h>
+#endif
 
 #ifdef USE_LIBV4L
 #  include <libv4l2.h>
 #else
-#  include <sys/ioctl.h>
 #  define v4l2_close close
 #  define v4l2_ioctl ioctl
 #  define v4l2_mmap mmap
@@ -37,26 +75,76 @@
 #  define v4l2_open open
 #endif
 
-#ifndef Py_TYPE
-#  define Py_TYPE(ob) (((PyObject*)(ob))->ob_type)
+#if PY_VERSION_HEX < 0x03090000
+#  error "pyv4l2 needs Python 3.9 or later"
 #endif
 
-#if PY_MAJOR_VERSION < 3
-#  define PyLong_FromLong PyInt_FromLong
-
-#  define PYOBJECT_HEAD_INIT(TYPE, SZ)	PyObject_HEAD_INIT(TYPE) SZ,
-#  define INIT_V4L2_WRAPPER(X)		initpyv4l2(X)
-#  define PYSTRING_FROM_STRING(NAME)	PyString_FromString(NAME)
-#  define PYSTRING_FROM_STR_SZ(V, LEN)	PyString_FromStringAndSize(V, LEN)
-#  define PYMODINIT_FUNC_RETURN(RET)
-#else /* PY_MAJOR_VERSION >= 3 */
-#  define PYOBJECT_HEAD_INIT(TYPE, SZ)	PyVarObject_HEAD_INIT(TYPE, SZ)
-#  define INIT_V4L2_WRAPPER(X)		PyInit_pyv4l2(X)
-#  define PYSTRING_FROM_STRING(NAME)	PyBytes_FromString(NAME)
-#  define PYSTRING_FROM_STR_SZ(V, LEN)	PyBytes_FromStringAndSize(V, LEN)
-#  define PYMODINIT_FUNC_RETURN(RET)	(RET)
+#define PYSTRING_FROM_STRING(NAME)	PyBytes_FromString(NAME)
+#define PYSTRING_FROM_STR_SZ(V, LEN)	PyBytes_FromStringAndSize(V, LEN)
+#define PYSTRING_AS_STRING(STR)		PyBytes_AS_STRING(STR)
+
+/*
+ * Free-threaded builds: methods run in a critical section of their object,
+ * so concurrent calls on one device are serialized while different devices
+ * run in parallel. The GIL already does this for the other builds.
+ */
+#ifdef Py_GIL_DISABLED
+#  define OBJECT_LOCK(OBJ)	Py_BEGIN_CRITICAL_SECTION(OBJ)
+#  define OBJECT_UNLOCK()	Py_END_CRITICAL_SECTION()
+#  define OBJECT_LOCK2(A, B)	Py_BEGIN_CRITICAL_SECTION2(A, B)
+#  define OBJECT_UNLOCK2()	Py_END_CRITICAL_SECTION2()
+#else
+#  define OBJECT_LOCK(OBJ)	{
+#  define OBJECT_UNLOCK()	}
+#  define OBJECT_LOCK2(A, B)	{
+#  define OBJECT_UNLOCK2()	}
 #endif
 
+#define LOCKED_NOARGS(NAME, TYPE)					\
+	static PyObject *NAME ## _locked(TYPE *self, PyObject *unused)	\
+	{								\
+		PyObject *ret = NULL;					\
+									\
+		OBJECT_LOCK((PyObject *)self);				\
+		ret = NAME(self);					\
+		OBJECT_UNLOCK();					\
+		return ret;						\
+	}
+
+#define LOCKED_VARARGS(NAME, TYPE)					\
+	static PyObject *NAME ## _locked(TYPE *self, PyObject *args)	\
+	{								\
+		PyObject *ret = NULL;					\
+									\
+		OBJECT_LOCK((PyObject *)self);				\
+		ret = NAME(self, args);					\
+		OBJECT_UNLOCK();					\
+		return ret;						\
+	}
+
+#define LOCKED_KEYWORDS(NAME, TYPE)					\
+	static PyObject *NAME ## _locked(TYPE *self, PyObject *args,	\
+					 PyObject *keywds)		\
+	{								\
+		PyObject *ret = NULL;					\
+									\
+		OBJECT_LOCK((PyObject *)self);				\
+		ret = NAME(self, args, keywds);				\
+		OBJECT_UNLOCK();					\
+		return ret;						\
+	}
+
+#ifndef V4L2_PIX_FMT_Y10P
+#  define V4L2_PIX_FMT_Y10P	v4l2_fourcc('Y', '1', '0', 'P')
+#endif /* !V4L2_PIX_FMT_Y10P */
+
+#ifndef V4L2_PIX_FMT_SRGGB10P
+#  define V4L2_PIX_FMT_SBGGR10P	v4l2_fourcc('p', 'B', 'A', 'A')
+#  define V4L2_PIX_FMT_SGBRG10P	v4l2_fourcc('p', 'G', 'A', 'A')
+#  define V4L2_PIX_FMT_SGRBG10P	v4l2_fourcc('p', 'g', 'A', 'A')
+#  define V4L2_PIX_FMT_SRGGB10P	v4l2_fourcc('p', 'R', 'A', 'A')
+#endif /* !V4L2_PIX_FMT_SRGGB10P */
+
 #ifndef V4L2_CID_AUTO_WHITE_BALANCE
 #  define V4L2_CID_AUTO_WHITE_BALANCE		-1
 #endif /* !V4L2_CID_AUTO_WHITE_BALANCE */
@@ -118,6 +206,45 @@ struct buffer {
 	size_t length;
 };
 
+/* Placement and priority of the threads waiting for frames */
+struct thread_setup {
+	int has_affinity;
+	cpu_set_t cpus;
+	int has_sched;
+	int policy;
+	int priority;
+	/* Changes with the settings, 0 until they are first set */
+	unsigned long generation;
+};
+
+/* Delay between the end of a frame (buffer timestamp) and its dequeue */
+struct timing_stats {
+	unsigned long long frames;
+	double mean;
+	double m2;
+	double min;
+	double max;
+};
+
+struct scaler;
+static void scaler_free(struct scaler *scaler);
+struct motion_gate;
+static void motion_gate_free(struct motion_gate *gate);
+struct frame_stats;
+static void frame_stats_free(struct frame_stats *stats);
+struct shm_ring;
+static void shm_ring_free(struct shm_ring *ring);
+struct demosaic;
+static void demosaic_free(struct demosaic *demosaic);
+struct recorder;
+static void recorder_free(struct recorder *recorder);
+struct capture_file;
+static int capture_close(struct capture_file *file);
+struct replay;
+static void replay_free(struct replay *replay);
+struct snapshots;
+static void snapshots_free(struct snapshots *snapshots);
+
 typedef struct {
 	PyObject_HEAD
 	int fd;
@@ -125,33 +252,216 @@ typedef struct {
 	struct buffer *buffers;
 	int buffer_count;
 	enum v4l2_buf_type type;
+	int lock_buffers;
+	struct thread_setup thread;
+	struct timing_stats timing;
+	struct v4l2_pix_format pix;
+	/* Decimation */
+	int decimate;
+	unsigned int decimate_count;
+	double interval;
+	double next_due;
+	double last_timestamp;
+	/* Region of interest cropped natively, width is 0 when unset */
+	struct v4l2_rect crop;
+	struct scaler *scaler;
+	struct motion_gate *gate;
+	struct frame_stats *stats;
+	struct shm_ring *ring;
+	struct demosaic *demosaic;
+	/* Bits delivered for high depth formats, 8 or 16 */
+	int depth;
+	struct recorder *recorder;
+	/* Capture file being recorded */
+	struct capture_file *capture;
+	/* Set for replay devices, which serve frames from a capture file */
+	struct replay *replay;
+	struct snapshots *snapshots;
+	/* Calls freeing or draining the snapshots without the GIL, no new
+	 * snapshot may be taken meanwhile */
+	int snapshots_blocked;
 } video_device;
 
+/* Per module (so per interpreter) state */
 typedef struct {
-	PyObject_HEAD
-	PyObject *types;
-} v4l2_module;
-
-
-#if PY_MAJOR_VERSION >= 3
-static PyObject *initmodule(char *m_name, PyModuleDef_Slot *m_methods,
-			    char *m_doc)
-{
-	static struct PyModuleDef moduledef = {
-		PyModuleDef_HEAD_INIT,
-		m_name,
-		m_doc,
-		-1,
-		m_methods,
-		NULL,
-		NULL,
-		NULL,
-		NULL
-	};
+	PyTypeObject *video_device_type;
+	PyTypeObject *replay_device_type;
+	PyTypeObject *m2m_device_type;
+	PyTypeObject *frame_subscriber_type;
+	PyTypeObject *shared_frame_type;
+	PyTypeObject *snapshot_future_type;
+	PyTypeObject *hotplug_monitor_type;
+} module_state;
+
+static struct PyModuleDef module_def;
+
+/* State of the module defining 'type' or one of its bases */
+static module_state *module_state_of(PyTypeObject *type)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+	return PyModule_GetState(PyType_GetModuleByDef(type, &module_def));
+#else
+	Py_ssize_t i;
+	PyObject *mro = type->tp_mro;
 
-	return PyModule_Create(&moduledef);
-}
+	for (i = 0; mro && i < PyTuple_GET_SIZE(mro); i++) {
+		PyTypeObject *base = (PyTypeObject *)PyTuple_GET_ITEM(mro, i);
+		PyObject *module = NULL;
+
+		if (!PyType_HasFeature(base, Py_TPFLAGS_HEAPTYPE))
+			continue;
+
+		module = ((PyHeapTypeObject *)base)->ht_module;
+		if (module && PyModule_GetDef(module) == &module_def)
+			return PyModule_GetState(module);
+	}
+
+	return NULL;
 #endif
+}
+
+static int str2fourcc(const char *str, int len, __u32 *fourcc)
+{
+	if (len != 4) {
+		PyErr_Format(PyExc_ValueError, "Invalid fourcc '%s'", str);
+		return -1;
+	}
+
+	*fourcc = v4l2_fourcc(str[0], str[1], str[2], str[3]);
+	return 0;
+}
+
+/* Printable code of a fourcc, whatever the host byte order */
+static const char *fourcc2str(__u32 fourcc, char str[5])
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		str[i] = (fourcc >> (8 * i)) & 0xff;
+		if (str[i] < ' ' || str[i] > '~')
+			str[i] = '?';
+	}
+	str[4] = '\0';
+
+	return str;
+}
+
+/*
+ * What the calling thread had before any setup, so that cleared settings can
+ * be undone, and the generation it last applied: each thread applies a setup
+ * once, however the readers alternate.
+ */
+static __thread struct {
+	unsigned long generation;
+	int saved;
+	cpu_set_t cpus;
+	int policy;
+	struct sched_param param;
+} thread_state;
+
+static unsigned long thread_setup_generations;
+
+/* Give the calling thread the settings, or back its own once cleared */
+static int thread_setup_apply(struct thread_setup *setup)
+{
+	int err = 0;
+	int policy = 0;
+	pthread_t self = pthread_self();
+	const cpu_set_t *cpus = NULL;
+	struct sched_param param;
+
+	if (!setup->generation || thread_state.generation == setup->generation)
+		return 0;
+
+	if (!thread_state.saved) {
+		if (!setup->has_affinity && !setup->has_sched) {
+			thread_state.generation = setup->generation;
+			return 0;
+		}
+
+		err = pthread_getaffinity_np(self, sizeof(cpu_set_t),
+					     &thread_state.cpus);
+		if (!err)
+			err = pthread_getschedparam(self, &thread_state.policy,
+						    &thread_state.param);
+		if (err)
+			goto error;
+		thread_state.saved = 1;
+	}
+
+	cpus = setup->has_affinity ? &setup->cpus : &thread_state.cpus;
+	err = pthread_setaffinity_np(self, sizeof(cpu_set_t), cpus);
+	if (err)
+		goto error;
+
+	policy = thread_state.policy;
+	param = thread_state.param;
+	if (setup->has_sched) {
+		policy = setup->policy;
+		param.sched_priority = setup->priority;
+	}
+
+	err = pthread_setschedparam(self, policy, &param);
+	if (err)
+		goto error;
+
+	thread_state.generation = setup->generation;
+	return 0;
+
+error:
+	errno = err;
+	PyErr_SetFromErrno(PyExc_OSError);
+	return -1;
+}
+
+/*
+ * Called by the setters once the settings changed. Generations are unique,
+ * the calling thread is only updated if it holds the previous one.
+ */
+static int thread_setup_changed(struct thread_setup *setup)
+{
+	int applied = setup->generation &&
+		thread_state.generation == setup->generation;
+
+	setup->generation = __atomic_add_fetch(&thread_setup_generations, 1,
+					       __ATOMIC_RELAXED);
+
+	return applied ? thread_setup_apply(setup) : 0;
+}
+
+static double monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void timing_stats_add(struct timing_stats *timing,
+			     const struct v4l2_buffer *buffer)
+{
+	double delta = 0;
+	double latency = 0;
+
+	/* Only monotonic timestamps compare with the wall clock */
+	if ((buffer->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+	    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		return;
+
+	latency = monotonic_now() - buffer->timestamp.tv_sec -
+		buffer->timestamp.tv_usec / 1000000.0;
+
+	if (!timing->frames || latency < timing->min)
+		timing->min = latency;
+	if (!timing->frames || latency > timing->max)
+		timing->max = latency;
+
+	/* Welford's running variance */
+	timing->frames++;
+	delta = latency - timing->mean;
+	timing->mean += delta / timing->frames;
+	timing->m2 += delta * (latency - timing->mean);
+}
 
 static int my_ioctl(int fd, int request, void *arg)
 {
@@ -167,17 +477,41 @@ static int my_ioctl(int fd, int request, void *arg)
 	return 0;
 }
 
+static int replay_ioctl(video_device *videodev, int request, void *arg);
+
+/* Replay devices emulate the driver */
+static int video_device_ioctl(video_device *videodev, int request, void *arg)
+{
+	if (videodev->replay)
+		return replay_ioctl(videodev, request, arg);
+
+	return my_ioctl(videodev->fd, request, arg);
+}
+
 static void video_device_unmap(video_device *videodev)
 {
 	int i;
 
+	/* Replayed buffers point in the capture file mapping */
+	if (videodev->replay)
+		return;
+
 	for (i = 0; i < videodev->buffer_count; i++)
 		v4l2_munmap(videodev->buffers[i].start,
 			    videodev->buffers[i].length);
 }
 
+static int replay_open(video_device *videodev);
+static void replay_close(video_device *videodev);
+
 static PyObject *video_device_open(video_device *videodev)
 {
+	if (videodev->replay) {
+		if (replay_open(videodev))
+			return NULL;
+		Py_RETURN_NONE;
+	}
+
 	videodev->fd = v4l2_open(videodev->path, O_RDWR | O_NONBLOCK);
 
 	if (videodev->fd < 0) {
@@ -188,26 +522,84 @@ static PyObject *video_device_open(video_device *videodev)
 	Py_RETURN_NONE;
 }
 
+/* Refuse what would race with a call flushing the snapshots */
+static int video_device_check_snapshots(video_device *videodev)
+{
+	if (!videodev->snapshots_blocked)
+		return 0;
+
+	PyErr_SetString(PyExc_ValueError, "Snapshots are being flushed by "
+			"close or set_demosaic");
+	return -1;
+}
+
 static PyObject *video_device_close(video_device *videodev)
 {
+	struct snapshots *snapshots = NULL;
+
 	if (0 > videodev->fd)
 		Py_RETURN_NONE;
 
+	if (video_device_check_snapshots(videodev))
+		return NULL;
+
+	/* Pending snapshots still read the buffers */
+	snapshots = videodev->snapshots;
+	videodev->snapshots = NULL;
+	videodev->snapshots_blocked++;
+	Py_BEGIN_ALLOW_THREADS
+	snapshots_free(snapshots);
+	Py_END_ALLOW_THREADS
+	videodev->snapshots_blocked--;
+
 	if (videodev->buffers)
 		video_device_unmap(videodev);
 
 	v4l2_close(videodev->fd);
 	videodev->fd = -1;
 
+	if (videodev->replay)
+		replay_close(videodev);
+
 	Py_RETURN_NONE;
 }
 
+static PyObject *video_device_new(PyTypeObject *type, PyObject *args,
+				  PyObject *kwargs)
+{
+	video_device *videodev = NULL;
+
+	videodev = (video_device *)PyType_GenericNew(type, args, kwargs);
+	if (videodev)
+		videodev->fd = -1;
+
+	return (PyObject *)videodev;
+}
+
 static int video_device_init(video_device *videodev,
 			     PyObject *args, PyObject *kwargs)
 {
-	if (!PyArg_ParseTuple(args, "is", &videodev->type, &videodev->path))
+	int type = 0;
+	const char *path = NULL;
+	PyObject *closed = NULL;
+
+	if (!PyArg_ParseTuple(args, "is", &type, &path))
+		return -1;
+
+	if (videodev->replay) {
+		PyErr_SetString(PyExc_ValueError, "Already initialized");
+		return -1;
+	}
+
+	/* Initialized again, release the device opened before */
+	closed = video_device_close(videodev);
+	if (!closed)
 		return -1;
+	Py_DECREF(closed);
 
+	free(videodev->buffers);
+	videodev->type = type;
+	videodev->path = path;
 	videodev->fd = -1;
 	videodev->buffers = NULL;
 	videodev->buffer_count = 0;
@@ -217,6 +609,10 @@ static int video_device_init(video_device *videodev,
 
 static void video_device_dealloc(video_device *videodev)
 {
+	PyTypeObject *type = NULL;
+
+	snapshots_free(videodev->snapshots);
+
 	if (0 <= videodev->fd) {
 		if (videodev->buffers)
 			video_device_unmap(videodev);
@@ -224,14 +620,34 @@ static void video_device_dealloc(video_device *videodev)
 		v4l2_close(videodev->fd);
 	}
 
-	Py_TYPE(videodev)->tp_free(videodev);
+	if (videodev->replay)
+		replay_close(videodev);
+
+	free(videodev->buffers);
+	capture_close(videodev->capture);
+	replay_free(videodev->replay);
+	scaler_free(videodev->scaler);
+	motion_gate_free(videodev->gate);
+	frame_stats_free(videodev->stats);
+	shm_ring_free(videodev->ring);
+	demosaic_free(videodev->demosaic);
+	recorder_free(videodev->recorder);
+
+	type = Py_TYPE(videodev);
+	type->tp_free(videodev);
+	Py_DECREF(type);
+}
+
+static PyObject *video_device_fileno(video_device *videodev)
+{
+	return PyLong_FromLong(videodev->fd);
 }
 
 static PyObject *video_device_get_info(video_device *videodev)
 {
 	struct v4l2_capability caps;
 
-	if (my_ioctl(videodev->fd, VIDIOC_QUERYCAP, &caps))
+	if (video_device_ioctl(videodev, VIDIOC_QUERYCAP, &caps))
 		return PyErr_SetFromErrno(PyExc_IOError);
 
 	return Py_BuildValue("sssi", caps.driver, caps.card, caps.bus_info,
@@ -265,7 +681,7 @@ static PyObject *video_device_set_format(video_device *videodev,
 	format.type = videodev->type;
 
 	/* Get the current format */
-	if (my_ioctl(videodev->fd, VIDIOC_G_FMT, &format))
+	if (video_device_ioctl(videodev, VIDIOC_G_FMT, &format))
 		return PyErr_SetFromErrno(PyExc_IOError);
 
 #ifdef USE_LIBV4L
@@ -289,9 +705,13 @@ static PyObject *video_device_set_format(video_device *videodev,
 	format.fmt.pix.height = size_y;
 	format.fmt.pix.bytesperline = 0;
 
-	if (my_ioctl(videodev->fd, VIDIOC_S_FMT, &format))
+	if (video_device_ioctl(videodev, VIDIOC_S_FMT, &format))
 		return PyErr_SetFromErrno(PyExc_IOError);
 
+	/* A native crop region is only valid for the format it was set on */
+	videodev->pix = format.fmt.pix;
+	CLEAR(videodev->crop);
+
 	return Py_BuildValue("ii", format.fmt.pix.width,
 			     format.fmt.pix.height);
 }
@@ -315,7 +735,7 @@ static PyObject *video_device_set_fps(video_device *videodev,
 		setfps.parm.output.timeperframe.denominator = fps;
 	}
 
-	if (my_ioctl(videodev->fd, VIDIOC_S_PARM, &setfps))
+	if (video_device_ioctl(videodev, VIDIOC_S_PARM, &setfps))
 		return PyErr_SetFromErrno(PyExc_IOError);
 
 	return Py_BuildValue("i", setfps.parm.capture.timeperframe.denominator);
@@ -333,7 +753,7 @@ static PyObject *video_device_get_formats(video_device *videodev)
 	if (0 == (list = PyList_New(0)))
 		return PyErr_SetFromErrno(PyExc_IOError);
 
-	while (!my_ioctl(videodev->fd, VIDIOC_ENUM_FMT, &format))
+	while (!video_device_ioctl(videodev, VIDIOC_ENUM_FMT, &format))
 	{
 		dict = Py_BuildValue("{s:i, s:i, s:s}",
 				     "type", format.type,
@@ -359,9 +779,11 @@ static PyObject *video_device_get_format(video_device *videodev)
 	format.type = videodev->type;
 
 	/* Get the current format */
-	if (my_ioctl(videodev->fd, VIDIOC_G_FMT, &format))
+	if (video_device_ioctl(videodev, VIDIOC_G_FMT, &format))
 		return PyErr_SetFromErrno(PyExc_IOError);
 
+	videodev->pix = format.fmt.pix;
+
 	return Py_BuildValue("iii", format.fmt.pix.width,
 			     format.fmt.pix.height,
 			     format.fmt.pix.pixelformat);
@@ -386,7 +808,7 @@ static PyObject *video_device_get_framesizes(video_device *videodev,
 	if (0 == (ret = PyList_New(0)))
 		return NULL;
 
-	while (!my_ioctl(videodev->fd, VIDIOC_ENUM_FRAMESIZES, &frmsize)) {
+	while (!video_device_ioctl(videodev, VIDIOC_ENUM_FRAMESIZES, &frmsize)) {
 		cap = PyDict_New();
 		switch (frmsize.type) {
 		case V4L2_FRMSIZE_TYPE_DISCRETE:
@@ -468,7 +890,7 @@ static PyObject *video_device_get_frameintervals(video_device *videodev,
 	if (0 == (ret = PyList_New(0)))
 		return NULL;
 
-	while (!my_ioctl(videodev->fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival)) {
+	while (!video_device_ioctl(videodev, VIDIOC_ENUM_FRAMEINTERVALS, &frmival)) {
 		cap = PyDict_New();
 
 		switch (frmival.type) {
@@ -515,7 +937,7 @@ static PyObject *video_device_start(video_device *videodev)
 
 	type = videodev->type;
 
-	if (my_ioctl(videodev->fd, VIDIOC_STREAMON, &type))
+	if (video_device_ioctl(videodev, VIDIOC_STREAMON, &type))
 		return PyErr_SetFromErrno(PyExc_IOError);
 
 	Py_RETURN_NONE;
@@ -527,7 +949,7 @@ static PyObject *video_device_stop(video_device *videodev)
 
 	type = videodev->type;
 
-	if (my_ioctl(videodev->fd, VIDIOC_STREAMOFF, &type))
+	if (video_device_ioctl(videodev, VIDIOC_STREAMOFF, &type))
 		return PyErr_SetFromErrno(PyExc_IOError);
 
 	Py_RETURN_NONE;
@@ -554,7 +976,7 @@ static PyObject *video_device_create_buffers(video_device *videodev,
 	reqbuf.type = videodev->type;
 	reqbuf.memory = V4L2_MEMORY_MMAP;
 
-	if (my_ioctl(videodev->fd, VIDIOC_REQBUFS, &reqbuf))
+	if (video_device_ioctl(videodev, VIDIOC_REQBUFS, &reqbuf))
 		return PyErr_SetFromErrno(PyExc_IOError);
 
 	if (!reqbuf.count)
@@ -570,10 +992,17 @@ static PyObject *video_device_create_buffers(video_device *videodev,
 		buffer.type = videodev->type;
 		buffer.memory = V4L2_MEMORY_MMAP;
 
-		if (my_ioctl(videodev->fd, VIDIOC_QUERYBUF, &buffer))
+		if (video_device_ioctl(videodev, VIDIOC_QUERYBUF, &buffer))
 			return PyErr_SetFromErrno(PyExc_IOError);
 
 		videodev->buffers[i].length = buffer.length;
+
+		/* Replayed buffers are pointed at the frames when dequeued */
+		if (videodev->replay) {
+			videodev->buffers[i].start = NULL;
+			continue;
+		}
+
 		videodev->buffers[i].start = v4l2_mmap(NULL, buffer.length,
 						       PROT_READ | PROT_WRITE,
 						       MAP_SHARED,
@@ -582,6 +1011,11 @@ static PyObject *video_device_create_buffers(video_device *videodev,
 
 		if (videodev->buffers[i].start == MAP_FAILED)
 			return PyErr_SetFromErrno(PyExc_IOError);
+
+		/* Locking also faults every page in now, not at first use */
+		if (videodev->lock_buffers &&
+		    mlock(videodev->buffers[i].start, buffer.length))
+			return PyErr_SetFromErrno(PyExc_IOError);
 	}
 
 	videodev->buffer_count = i;
@@ -606,348 +1040,7869 @@ static PyObject *video_device_queue_all_buffers(video_device *videodev)
 		buffer.type = videodev->type;
 		buffer.memory = V4L2_MEMORY_MMAP;
 
-		if (my_ioctl(videodev->fd, VIDIOC_QBUF, &buffer))
+		if (video_device_ioctl(videodev, VIDIOC_QBUF, &buffer))
 			return PyErr_SetFromErrno(PyExc_IOError);
 	}
 
 	Py_RETURN_NONE;
 }
 
-#ifdef USE_LIBV4L
-static PyObject *video_device_yuyv2rgb(video_device *videodev,
-				       struct v4l2_buffer *buffer,
-				       int length)
-{
-	return PYSTRING_FROM_STR_SZ(videodev->buffers[buffer->index].start,
-				    buffer->bytesused);
-}
-#else /* !USE_LIBV4L */
-static PyObject *video_device_yuyv2rgb(video_device *videodev,
-				       struct v4l2_buffer *buffer,
-				       int length)
+static PyObject *video_device_export_buffers(video_device *videodev)
 {
-	int u = 0;
-	int v = 0;
-	int uv = 0;
-	int y = 0;
-	char *rgb = NULL;
-	char *rgb_max = NULL;
-	unsigned char *yuyv = NULL;
-	PyObject *result = Py_None;
+	int i = 0;
+	PyObject *fd = NULL;
+	PyObject *list = NULL;
+	struct v4l2_exportbuffer expbuf;
 
-	result = PYSTRING_FROM_STR_SZ(NULL, length);
+	if (!videodev->buffers) {
+		PyErr_SetString(PyExc_ValueError,
+				"Buffers have not been created");
+		return NULL;
+	}
 
-	// Convert buffer from YUYV to RGB.
-	// For the byte order, see: http://v4l2spec.bytesex.org/spec/r4339.htm
-	// For the color conversion, see: http://v4l2spec.bytesex.org/spec/x2123.htm
+	if (0 == (list = PyList_New(0)))
+		return NULL;
 
-	if (!result)
-		return PyErr_Format("Failed to get the string");
+	for (i = 0; i < videodev->buffer_count; i++) {
+		CLEAR(expbuf);
+		expbuf.type = videodev->type;
+		expbuf.index = i;
+		expbuf.flags = O_CLOEXEC | O_RDWR;
 
-	rgb = PyString_AS_STRING(result);
-	rgb_max = rgb + length;
-	yuyv = videodev->buffers[buffer->index].start;
+		if (video_device_ioctl(videodev, VIDIOC_EXPBUF, &expbuf)) {
+			PyErr_SetFromErrno(PyExc_IOError);
+			goto error;
+		}
 
-	while (rgb < rgb_max) {
-		u = yuyv[1] - 128;
-		v = yuyv[3] - 128;
-		uv = 100 * u + 208 * v;
-		u *= 516;
-		v *= 409;
+		fd = PyLong_FromLong(expbuf.fd);
+		if (!fd || PyList_Append(list, fd)) {
+			Py_XDECREF(fd);
+			close(expbuf.fd);
+			goto error;
+		}
+		Py_DECREF(fd);
+	}
 
-		y = 298 * (yuyv[0] - 16);
-		rgb[0] = CLAMP(y + v);
-		rgb[1] = CLAMP(y - uv);
-		rgb[2] = CLAMP(y + u);
+	return list;
 
-		y = 298 * (yuyv[2] - 16);
-		rgb[3] = CLAMP(y + v);
-		rgb[4] = CLAMP(y - uv);
-		rgb[5] = CLAMP(y + u);
+error:
+	/* The caller never sees the descriptors already exported */
+	for (i = 0; i < PyList_GET_SIZE(list); i++)
+		close(PyLong_AsLong(PyList_GET_ITEM(list, i)));
+	Py_DECREF(list);
+	return NULL;
+}
 
-		rgb += 6;
-		yuyv += 4;
+/*
+ * Frame conversion
+ *
+ * A frame describes a dequeued buffer and the region of it delivered to the
+ * caller. Conversions work row by row and honor bytesperline, so cropping
+ * costs nothing more than the pixels that are kept.
+ */
+struct frame {
+	const unsigned char *data;
+	size_t size;
+	__u32 fourcc;
+	unsigned int stride;
+	unsigned int width;
+	unsigned int height;
+	struct v4l2_rect rect;
+	struct frame_stats *stats;
+	/* Set when raw Bayer frames are demosaiced */
+	struct demosaic_lane *bayer;
+	/* Deliver the 8 most significant bits of high depth formats */
+	int to_8bit;
+};
+
+/* Bytes per pixel of packed formats, 0 for planar or compressed ones */
+static unsigned int fourcc_bpp(__u32 fourcc)
+{
+	switch (fourcc) {
+	case V4L2_PIX_FMT_GREY:
+	case V4L2_PIX_FMT_SBGGR8:
+	case V4L2_PIX_FMT_SGBRG8:
+	case V4L2_PIX_FMT_SGRBG8:
+	case V4L2_PIX_FMT_SRGGB8:
+		return 1;
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_VYUY:
+	case V4L2_PIX_FMT_RGB565:
+	case V4L2_PIX_FMT_Y10:
+	case V4L2_PIX_FMT_Y12:
+	case V4L2_PIX_FMT_Y16:
+	case V4L2_PIX_FMT_SBGGR10:
+	case V4L2_PIX_FMT_SGBRG10:
+	case V4L2_PIX_FMT_SGRBG10:
+	case V4L2_PIX_FMT_SRGGB10:
+		return 2;
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+		return 3;
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_BGR32:
+		return 4;
+	default:
+		return 0;
 	}
 }
-#endif /* USE_LIBV4L */
 
-static PyObject *video_device_read_internal(video_device *videodev,
-					    int queue)
+/*
+ * MIPI RAW10 packing: four pixels in five bytes, the eight most significant
+ * bits of each pixel then a byte with their two least significant bits.
+ */
+static int fourcc_is_packed10(__u32 fourcc)
 {
-	int length = 0;
-	PyObject *result = Py_None;
-	struct v4l2_buffer buffer;
+	switch (fourcc) {
+	case V4L2_PIX_FMT_Y10P:
+	case V4L2_PIX_FMT_SBGGR10P:
+	case V4L2_PIX_FMT_SGBRG10P:
+	case V4L2_PIX_FMT_SGRBG10P:
+	case V4L2_PIX_FMT_SRGGB10P:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-	if (!videodev->buffers) {
-		PyErr_SetString(PyExc_ValueError,
-				"Buffers have not been created");
-		Py_RETURN_NONE;
+/* Bytes taken by 'width' pixels of a row, 0 for planar or compressed ones */
+static size_t fourcc_row_bytes(__u32 fourcc, unsigned int width)
+{
+	if (fourcc_is_packed10(fourcc))
+		return (size_t)width * 5 / 4;
+
+	return (size_t)width * fourcc_bpp(fourcc);
+}
+
+/* Significant bits of high depth formats, 0 for the 8 bit ones */
+static unsigned int fourcc_depth(__u32 fourcc)
+{
+	switch (fourcc) {
+	case V4L2_PIX_FMT_Y10:
+	case V4L2_PIX_FMT_Y10P:
+	case V4L2_PIX_FMT_SBGGR10:
+	case V4L2_PIX_FMT_SGBRG10:
+	case V4L2_PIX_FMT_SGRBG10:
+	case V4L2_PIX_FMT_SRGGB10:
+	case V4L2_PIX_FMT_SBGGR10P:
+	case V4L2_PIX_FMT_SGBRG10P:
+	case V4L2_PIX_FMT_SGRBG10P:
+	case V4L2_PIX_FMT_SRGGB10P:
+		return 10;
+	case V4L2_PIX_FMT_Y12:
+		return 12;
+	case V4L2_PIX_FMT_Y16:
+		return 16;
+	default:
+		return 0;
 	}
+}
 
-	buffer.type = videodev->type;
-	buffer.memory = V4L2_MEMORY_MMAP;
+/* Format of a high depth one once unpacked to 16 or reduced to 8 bits */
+static __u32 fourcc_unpacked(__u32 fourcc, int to_8bit)
+{
+	switch (fourcc) {
+	case V4L2_PIX_FMT_SBGGR10:
+	case V4L2_PIX_FMT_SBGGR10P:
+		return to_8bit ? V4L2_PIX_FMT_SBGGR8 : V4L2_PIX_FMT_SBGGR10;
+	case V4L2_PIX_FMT_SGBRG10:
+	case V4L2_PIX_FMT_SGBRG10P:
+		return to_8bit ? V4L2_PIX_FMT_SGBRG8 : V4L2_PIX_FMT_SGBRG10;
+	case V4L2_PIX_FMT_SGRBG10:
+	case V4L2_PIX_FMT_SGRBG10P:
+		return to_8bit ? V4L2_PIX_FMT_SGRBG8 : V4L2_PIX_FMT_SGRBG10;
+	case V4L2_PIX_FMT_SRGGB10:
+	case V4L2_PIX_FMT_SRGGB10P:
+		return to_8bit ? V4L2_PIX_FMT_SRGGB8 : V4L2_PIX_FMT_SRGGB10;
+	case V4L2_PIX_FMT_Y10P:
+		return to_8bit ? V4L2_PIX_FMT_GREY : V4L2_PIX_FMT_Y10;
+	default:
+		return to_8bit ? V4L2_PIX_FMT_GREY : fourcc;
+	}
+}
 
-	if (my_ioctl(videodev->fd, VIDIOC_DQBUF, &buffer))
-		return PyErr_SetFromErrno(PyExc_IOError);
+/* Horizontal and vertical alignment a crop rectangle must respect */
+static int fourcc_crop_align(__u32 fourcc, unsigned int *align_x,
+			     unsigned int *align_y)
+{
+	*align_x = 1;
+	*align_y = 1;
+
+	switch (fourcc) {
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		*align_y = 2;
+		/* Fallthrough */
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_VYUY:
+		*align_x = 2;
+		return 0;
+	default:
+		if (fourcc_is_packed10(fourcc)) {
+			*align_x = 4;
+			return 0;
+		}
+		return fourcc_bpp(fourcc) ? 0 : -1;
+	}
+}
+
+static __u32 frame_output_fourcc(const struct frame *frame)
+{
+	if (frame->bayer)
+		return V4L2_PIX_FMT_RGB24;
 
-	length = buffer.bytesused * 6 / 4;
+	if (fourcc_depth(frame->fourcc))
+		return fourcc_unpacked(frame->fourcc, frame->to_8bit);
 
-	PyErr_Clear();
-	result = video_device_yuyv2rgb(videodev, &buffer, length);
-	if (PyErr_Occurred())
-		return result;
+#ifndef USE_LIBV4L
+	if (frame->fourcc == V4L2_PIX_FMT_YUYV)
+		return V4L2_PIX_FMT_RGB24;
+#endif
+	return frame->fourcc;
+}
 
-	if (queue && my_ioctl(videodev->fd, VIDIOC_QBUF, &buffer))
-		return PyErr_SetFromErrno(PyExc_IOError);
+static const unsigned char *frame_row(const struct frame *frame,
+				      unsigned int y)
+{
+	return frame->data + (frame->rect.top + y) * frame->stride +
+		fourcc_row_bytes(frame->fourcc, frame->rect.left);
+}
 
-	return result;
+static int frame_is_planar(const struct frame *frame)
+{
+	return frame->fourcc == V4L2_PIX_FMT_YUV420 ||
+		frame->fourcc == V4L2_PIX_FMT_YVU420;
 }
 
-static PyObject *video_device_read(video_device *videodev)
+static int frame_is_compressed(const struct frame *frame)
 {
-	return video_device_read_internal(videodev, 0);
+	return !fourcc_row_bytes(frame->fourcc, 1) && !frame_is_planar(frame);
 }
 
-static PyObject *video_device_read_and_queue(video_device *videodev)
+static size_t frame_output_size(const struct frame *frame)
 {
-	return video_device_read_internal(videodev, 1);
+	size_t pixels = (size_t)frame->rect.width * frame->rect.height;
+
+	if (frame_is_planar(frame))
+		return pixels * 3 / 2;
+
+	if (frame_is_compressed(frame))
+		return frame->size;
+
+	return pixels * fourcc_bpp(frame_output_fourcc(frame));
 }
 
-static PyObject *video_device_set_helper(int id,
-					 video_device *videodev,
-					 PyObject *args)
+/* Check the region lies inside the mapped buffer */
+static int frame_check(const struct frame *frame)
 {
-	int value = 0;
-	struct v4l2_control ctrl;
+	size_t last = 0;
+
+	if (frame_is_compressed(frame))
+		return 0;
+
+	/* Compared without adding, which could wrap */
+	if (frame->rect.left < 0 || frame->rect.top < 0 ||
+	    (unsigned int)frame->rect.left > frame->width ||
+	    frame->rect.width > frame->width - frame->rect.left ||
+	    (unsigned int)frame->rect.top > frame->height ||
+	    frame->rect.height > frame->height - frame->rect.top) {
+		PyErr_Format(PyExc_IOError, "Region outside of the %ux%u "
+			     "frame", frame->width, frame->height);
+		return -1;
+	}
 
-	CLEAR(ctrl);
+	last = ((size_t)frame->rect.top + frame->rect.height) * frame->stride;
+	if (frame_is_planar(frame))
+		last = (size_t)frame->height * frame->stride * 3 / 2;
 
-	if (0 > id)
-		Py_RETURN_NONE;
+	if (last > frame->size) {
+		PyErr_Format(PyExc_IOError, "Truncated frame: %zu bytes "
+			     "expected, %zu available", last, frame->size);
+		return -1;
+	}
 
-	if (!PyArg_ParseTuple(args, "i", &value))
-		Py_RETURN_NONE;
+	return 0;
+}
 
-	ctrl.id = id;
-	ctrl.value = value;
+/*
+ * Frame statistics
+ *
+ * Accumulated on each row right after it is converted, while it is still in
+ * the cache: luma histogram, channel means and a focus score, the variance
+ * of the Laplacian of the luma sampled every 'step' pixels.
+ */
+struct frame_stats {
+	unsigned int step;
+	unsigned int channels;
+	int bgr;
+	unsigned int width;
+	unsigned char *luma[3];
+	long last_row;
+	unsigned int run;
+	unsigned long histogram[256];
+	unsigned long long sums[4];
+	unsigned long long pixels;
+	long long lap_sum;
+	unsigned long long lap_square;
+	unsigned long long lap_count;
+	int valid;
+};
 
-	if (my_ioctl(videodev->fd, VIDIOC_S_CTRL, &ctrl))
-		Py_RETURN_NONE;
+static void frame_stats_free(struct frame_stats *stats)
+{
+	if (!stats)
+		return;
 
-	return Py_BuildValue("i", ctrl.value);
+	free(stats->luma[0]);
+	free(stats);
 }
 
-static PyObject *video_device_get_helper(int id,
-					 video_device *videodev)
+/* Prepare for a new frame, whose rows are 'width' pixels of 'channels' */
+static int frame_stats_begin(struct frame_stats *stats, unsigned int width,
+			     unsigned int channels, int bgr)
 {
-	struct v4l2_control ctrl;
+	if (width != stats->width) {
+		free(stats->luma[0]);
+		stats->luma[0] = malloc(3 * (size_t)width);
+		if (!stats->luma[0]) {
+			stats->width = 0;
+			PyErr_NoMemory();
+			return -1;
+		}
 
-	CLEAR(ctrl);
-	ctrl.id = id;
+		stats->luma[1] = stats->luma[0] + width;
+		stats->luma[2] = stats->luma[1] + width;
+		stats->width = width;
+	}
 
-	if (my_ioctl(videodev->fd, VIDIOC_G_CTRL, &ctrl))
-		Py_RETURN_NONE;
+	stats->channels = channels;
+	stats->bgr = bgr;
+	stats->last_row = -1;
+	stats->run = 0;
+	stats->pixels = 0;
+	stats->lap_sum = 0;
+	stats->lap_square = 0;
+	stats->lap_count = 0;
+	stats->valid = channels != 0;
+	memset(stats->histogram, 0, sizeof(stats->histogram));
+	memset(stats->sums, 0, sizeof(stats->sums));
 
-	return Py_BuildValue("i", ctrl.value);
+	return 0;
 }
 
-DECLARE_METHODS(auto_wb, V4L2_CID_AUTO_WHITE_BALANCE);
-DECLARE_METHODS(wb_temperature, V4L2_CID_WHITE_BALANCE_TEMPERATURE);
-DECLARE_METHODS(exposure_absolute, V4L2_CID_EXPOSURE_ABSOLUTE);
-DECLARE_METHODS(exposure_auto, V4L2_CID_EXPOSURE_AUTO);
-DECLARE_METHODS(focus_auto, V4L2_CID_FOCUS_AUTO);
+static void frame_stats_laplacian(struct frame_stats *stats,
+				  const unsigned char *up,
+				  const unsigned char *center,
+				  const unsigned char *down)
+{
+	unsigned int x;
+	long long sum = 0;
+	unsigned long long square = 0;
+	unsigned long long count = 0;
 
-static PyMethodDef video_device_methods[] = {
-	{
-		"open", (PyCFunction)video_device_open, METH_NOARGS,
-		"open()\n\n"
-		"Open the video device."
-	},
-	{
-		"close", (PyCFunction)video_device_close, METH_NOARGS,
-		"close()\n\n"
-		"Close the video device."},
-	{
-		"get_info", (PyCFunction)video_device_get_info, METH_NOARGS,
+	for (x = 1; x + 1 < stats->width; x += stats->step, count++) {
+		int lap = 4 * center[x] - center[x - 1] - center[x + 1] -
+			up[x] - down[x];
+
+		sum += lap;
+		square += lap * lap;
+	}
+
+	stats->lap_sum += sum;
+	stats->lap_square += square;
+	stats->lap_count += count;
+}
+
+static void frame_stats_row(struct frame_stats *stats,
+			    const unsigned char *row, unsigned int y)
+{
+	unsigned int x;
+	unsigned int c;
+	unsigned int width = stats->width;
+	unsigned int channels = stats->channels;
+	unsigned int r = stats->bgr ? 2 : 0;
+	unsigned int b = stats->bgr ? 0 : 2;
+	unsigned char *luma = stats->luma[y % 3];
+
+	/* Rows fetched twice by the scaler are only counted once */
+	if (!stats->valid || (long)y <= stats->last_row)
+		return;
+
+	stats->run = (long)y == stats->last_row + 1 ? stats->run + 1 : 1;
+	stats->last_row = y;
+
+	if (channels == 1) {
+		memcpy(luma, row, width);
+	} else {
+		const unsigned char *pixel = row;
+
+		for (x = 0; x < width; x++, pixel += channels)
+			luma[x] = (77 * pixel[r] + 150 * pixel[1] +
+				   29 * pixel[b] + 128) >> 8;
+	}
+
+	for (c = 0; c < channels && c < 4; c++) {
+		unsigned long long sum = 0;
+		const unsigned char *pixel = row + c;
+
+		for (x = 0; x < width; x++, pixel += channels)
+			sum += *pixel;
+		stats->sums[c] += sum;
+	}
+
+	for (x = 0; x < width; x++)
+		stats->histogram[luma[x]]++;
+	stats->pixels += width;
+
+	if (stats->run >= 3 && (y - 1) % stats->step == 0)
+		frame_stats_laplacian(stats, stats->luma[(y - 2) % 3],
+				      stats->luma[(y - 1) % 3], luma);
+}
+
+static PyObject *frame_stats_to_dict(const struct frame_stats *stats)
+{
+	unsigned int i;
+	double mean = 0;
+	double focus = 0;
+	unsigned long long luma = 0;
+	PyObject *histogram = NULL;
+	PyObject *means = NULL;
+	PyObject *dict = NULL;
+
+	if (!stats->valid || !stats->pixels)
+		Py_RETURN_NONE;
+
+	histogram = PyList_New(256);
+	means = PyTuple_New(stats->channels);
+	if (!histogram || !means)
+		goto error;
+
+	for (i = 0; i < 256; i++) {
+		luma += (unsigned long long)i * stats->histogram[i];
+		PyList_SET_ITEM(histogram, i,
+				PyLong_FromUnsignedLong(stats->histogram[i]));
+	}
+
+	for (i = 0; i < stats->channels; i++)
+		PyTuple_SET_ITEM(means, i, PyFloat_FromDouble(
+					 (double)stats->sums[i] /
+					 stats->pixels));
+
+	if (stats->lap_count) {
+		mean = (double)stats->lap_sum / stats->lap_count;
+		focus = (double)stats->lap_square / stats->lap_count -
+			mean * mean;
+	}
+
+	dict = Py_BuildValue("{s:O, s:O, s:d, s:d}",
+			     "histogram", histogram,
+			     "means", means,
+			     "luma", (double)luma / stats->pixels,
+			     "focus", focus);
+
+error:
+	Py_XDECREF(histogram);
+	Py_XDECREF(means);
+	return dict;
+}
+
+/* Hand a converted row to the statistics, if they are enabled */
+static void frame_emit_row(const struct frame *frame,
+			   const unsigned char *row, unsigned int y)
+{
+	if (frame->stats)
+		frame_stats_row(frame->stats, row, y);
+}
+
+static void convert_yuyv_rgb_row(const unsigned char *yuyv,
+				 unsigned char *rgb, unsigned int width)
+{
+	int u = 0;
+	int v = 0;
+	int uv = 0;
+	int y = 0;
+	unsigned char *rgb_max = rgb + width * 3;
+
+	// For the byte order, see: http://v4l2spec.bytesex.org/spec/r4339.htm
+	// For the color conversion, see: http://v4l2spec.bytesex.org/spec/x2123.htm
+	while (rgb < rgb_max) {
+		u = yuyv[1] - 128;
+		v = yuyv[3] - 128;
+		uv = 100 * u + 208 * v;
+		u *= 516;
+		v *= 409;
+
+		y = 298 * (yuyv[0] - 16);
+		rgb[0] = CLAMP(y + v);
+		rgb[1] = CLAMP(y - uv);
+		rgb[2] = CLAMP(y + u);
+
+		y = 298 * (yuyv[2] - 16);
+		rgb[3] = CLAMP(y + v);
+		rgb[4] = CLAMP(y - uv);
+		rgb[5] = CLAMP(y + u);
+
+		rgb += 6;
+		yuyv += 4;
+	}
+}
+
+/*
+ * High depth formats
+ *
+ * 16 bit samples are little endian in the frame and delivered the same way,
+ * so a row can be viewed as numpy uint16 whatever the alignment of the
+ * destination. Previews may keep only the 8 most significant bits.
+ */
+static void unpack16_8_row(const unsigned char *src, unsigned char *dst,
+			   unsigned int width, unsigned int shift)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	__m128i count = _mm_cvtsi32_si128(shift);
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+		__m128i hi = _mm_loadu_si128((const __m128i *)
+					     (src + 2 * x + 16));
+
+		_mm_storeu_si128((__m128i *)(dst + x),
+				 _mm_packus_epi16(_mm_srl_epi16(lo, count),
+						  _mm_srl_epi16(hi, count)));
+	}
+#elif defined(__ARM_NEON)
+	int16x8_t count = vdupq_n_s16(-(int)shift);
+
+	for (; x + 16 <= width; x += 16) {
+		uint16x8_t lo = vreinterpretq_u16_u8(vld1q_u8(src + 2 * x));
+		uint16x8_t hi = vreinterpretq_u16_u8(vld1q_u8(src + 2 * x +
+							      16));
+
+		vst1q_u8(dst + x, vcombine_u8(vqmovn_u16(vshlq_u16(lo, count)),
+					      vqmovn_u16(vshlq_u16(hi,
+								   count))));
+	}
+#endif
+
+	for (; x < width; x++) {
+		unsigned int value = (src[2 * x] | src[2 * x + 1] << 8) >> shift;
+
+		dst[x] = value > 255 ? 255 : value;
+	}
+}
+
+/* Pixel x of a RAW10 packed row */
+static unsigned int unpack10p_pixel(const unsigned char *src, unsigned int x)
+{
+	const unsigned char *group = src + x / 4 * 5;
+
+	return group[x % 4] << 2 | ((group[4] >> (2 * (x % 4))) & 3);
+}
+
+#ifdef HAVE_SSSE3_KERNELS
+/* Unpacks all but the last pixels of the row, returns how many */
+__attribute__((target("ssse3")))
+static unsigned int unpack10p_16_ssse3(const unsigned char *src,
+				       unsigned char *dst, unsigned int width)
+{
+	unsigned int x = 0;
+	/* Two groups: each pixel as its low bits byte and its high byte */
+	__m128i shuffle = _mm_setr_epi8(4, 0, 4, 1, 4, 2, 4, 3,
+					9, 5, 9, 6, 9, 7, 9, 8);
+	/* Bring the two low bits of each pixel to bits 6 and 7 */
+	__m128i align = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+	__m128i high_mask = _mm_set1_epi16(0x3fc);
+	__m128i byte_mask = _mm_set1_epi16(0xff);
+	__m128i low_mask = _mm_set1_epi16(3);
+
+	/* 16 bytes are loaded for 10 used, stay inside the row */
+	for (; x + 16 <= width; x += 8) {
+		__m128i packed = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(src + x / 4 * 5)),
+			shuffle);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(packed, 6),
+					     high_mask);
+		__m128i low = _mm_mullo_epi16(_mm_and_si128(packed, byte_mask),
+					      align);
+
+		low = _mm_and_si128(_mm_srli_epi16(low, 6), low_mask);
+		_mm_storeu_si128((__m128i *)(dst + 2 * x),
+				 _mm_or_si128(high, low));
+	}
+
+	return x;
+}
+#endif
+
+static void unpack10p_16_row(const unsigned char *src, unsigned char *dst,
+			     unsigned int width)
+{
+	unsigned int x = 0;
+
+#ifdef HAVE_SSSE3_KERNELS
+	if (__builtin_cpu_supports("ssse3"))
+		x = unpack10p_16_ssse3(src, dst, width);
+#endif
+
+	for (; x < width; x++) {
+		unsigned int value = unpack10p_pixel(src, x);
+
+		dst[2 * x] = value;
+		dst[2 * x + 1] = value >> 8;
+	}
+}
+
+static void unpack10p_8_row(const unsigned char *src, unsigned char *dst,
+			    unsigned int width)
+{
+	unsigned int x = 0;
+
+	/* The high bytes are the first four of each group */
+	for (; x + 4 <= width; x += 4, src += 5, dst += 4)
+		memcpy(dst, src, 4);
+
+	for (; x < width; x++)
+		*dst++ = src[x % 4];
+}
+
+/* Row y of a high depth frame, unpacked to 16 bits or reduced to 8 */
+static void frame_unpack_row(const struct frame *frame, unsigned int y,
+			     unsigned char *dst)
+{
+	const unsigned char *src = frame_row(frame, y);
+	unsigned int width = frame->rect.width;
+
+	if (!fourcc_is_packed10(frame->fourcc))
+		unpack16_8_row(src, dst, width,
+			       fourcc_depth(frame->fourcc) - 8);
+	else if (frame->to_8bit)
+		unpack10p_8_row(src, dst, width);
+	else
+		unpack10p_16_row(src, dst, width);
+}
+
+/*
+ * Bayer demosaicing
+ *
+ * Raw sensor mosaics are interpolated to RGB24 row by row, so the scaler and
+ * the statistics get their rows straight from the demosaic. Each lane keeps
+ * the few raw rows (padded by reflection) and interpolated green rows the
+ * current row needs. Whole frames can be split in bands handled by a pool of
+ * threads, one lane each.
+ */
+#define DEMOSAIC_NONE		0
+#define DEMOSAIC_BILINEAR	1
+#define DEMOSAIC_EDGE		2
+
+#define DEMOSAIC_PAD		4
+#define DEMOSAIC_RAW_ROWS	8
+#define DEMOSAIC_MAX_THREADS	64
+
+#define AVG(a, b)	(((a) + (b) + 1) >> 1)
+
+struct demosaic_lane {
+	struct demosaic *pool;
+	unsigned int width;
+	unsigned char *raw;
+	long raw_row[DEMOSAIC_RAW_ROWS];
+	unsigned char *green;
+	long green_row[3];
+	unsigned char *planes;
+};
+
+struct demosaic {
+	int method;
+	unsigned int threads;
+	struct demosaic_lane *lanes;
+	pthread_t *workers;
+	unsigned int started;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	unsigned long generation;
+	unsigned int pending;
+	int quit;
+	const struct frame *frame;
+	unsigned char *dst;
+};
+
+/* Position of the red sample in the 2x2 pattern, -1 for other formats */
+static int fourcc_bayer(__u32 fourcc, unsigned int *red_x,
+			unsigned int *red_y)
+{
+	switch (fourcc) {
+	case V4L2_PIX_FMT_SRGGB8:
+		*red_x = 0;
+		*red_y = 0;
+		return 0;
+	case V4L2_PIX_FMT_SGRBG8:
+		*red_x = 1;
+		*red_y = 0;
+		return 0;
+	case V4L2_PIX_FMT_SGBRG8:
+		*red_x = 0;
+		*red_y = 1;
+		return 0;
+	case V4L2_PIX_FMT_SBGGR8:
+		*red_x = 1;
+		*red_y = 1;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Mirror an out of range coordinate, keeping the parity of the pattern */
+static long demosaic_reflect(long i, long n)
+{
+	if (i < 0)
+		i = -i;
+	if (i >= n)
+		i = 2 * (n - 1) - i;
+
+	return i < 0 ? 0 : i >= n ? n - 1 : i;
+}
+
+static unsigned char demosaic_clamp(int value)
+{
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+/*
+ * Where the row of the frame starts on its own color (red or blue), and
+ * which one it is. 'phase' is 1 when its first pixel is green.
+ */
+static void demosaic_row_phase(const struct frame *frame, long sy,
+			       unsigned int *phase, int *red_row)
+{
+	unsigned int red_x = 0;
+	unsigned int red_y = 0;
+	unsigned int own_x = 0;
+
+	fourcc_bayer(frame->fourcc, &red_x, &red_y);
+	*red_row = (unsigned int)(sy & 1) == red_y;
+	own_x = *red_row ? red_x : red_x ^ 1;
+	*phase = (frame->rect.left & 1) != own_x;
+}
+
+static void demosaic_lane_free(struct demosaic_lane *lane)
+{
+	free(lane->raw);
+	free(lane->green);
+	free(lane->planes);
+	lane->raw = NULL;
+	lane->green = NULL;
+	lane->planes = NULL;
+	lane->width = 0;
+}
+
+/* Size the lane for the frame and forget the rows of the previous one */
+static int demosaic_lane_begin(struct demosaic_lane *lane,
+			       const struct frame *frame)
+{
+	unsigned int i;
+	size_t width = frame->rect.width;
+
+	if (lane->width != width) {
+		demosaic_lane_free(lane);
+		lane->raw = malloc(DEMOSAIC_RAW_ROWS *
+				   (width + 2 * DEMOSAIC_PAD));
+		lane->green = malloc(3 * (width + 2));
+		lane->planes = malloc(3 * width);
+		if (!lane->raw || !lane->green || !lane->planes) {
+			demosaic_lane_free(lane);
+			PyErr_NoMemory();
+			return -1;
+		}
+		lane->width = width;
+	}
+
+	for (i = 0; i < DEMOSAIC_RAW_ROWS; i++)
+		lane->raw_row[i] = -1;
+	for (i = 0; i < 3; i++)
+		lane->green_row[i] = -1;
+
+	return 0;
+}
+
+/* Raw row sy of the frame, padded by reflection on both sides */
+static const unsigned char *demosaic_raw_row(struct demosaic_lane *lane,
+					     const struct frame *frame,
+					     long sy)
+{
+	int x;
+	unsigned int slot = 0;
+	unsigned char *row = NULL;
+	const unsigned char *src = NULL;
+	long left = frame->rect.left;
+	int width = frame->rect.width;
+
+	sy = demosaic_reflect(sy, frame->height);
+	slot = sy % DEMOSAIC_RAW_ROWS;
+	row = lane->raw + slot * (width + 2 * DEMOSAIC_PAD) + DEMOSAIC_PAD;
+	if (lane->raw_row[slot] == sy)
+		return row;
+
+	src = frame->data + sy * frame->stride;
+	memcpy(row, src + left, width);
+	for (x = 1; x <= DEMOSAIC_PAD; x++) {
+		row[-x] = src[demosaic_reflect(left - x, frame->width)];
+		row[width - 1 + x] =
+			src[demosaic_reflect(left + width - 1 + x,
+					     frame->width)];
+	}
+
+	lane->raw_row[slot] = sy;
+	return row;
+}
+
+/*
+ * Green of a raw row from x = -1 to width included, from the rows two above
+ * to two below it. Every candidate is computed for every pixel and the one
+ * kept is selected without branching, so the loop vectorizes.
+ */
+static void demosaic_green_span(const unsigned char *restrict up2,
+				const unsigned char *restrict up,
+				const unsigned char *restrict c,
+				const unsigned char *restrict down,
+				const unsigned char *restrict down2,
+				int width, unsigned int phase,
+				unsigned char *restrict green)
+{
+	int x;
+
+	for (x = -1; x <= width; x++) {
+		int lap_h = 2 * c[x] - c[x - 2] - c[x + 2];
+		int lap_v = 2 * c[x] - up2[x] - down2[x];
+		int grad_h = abs(c[x - 1] - c[x + 1]) + abs(lap_h);
+		int grad_v = abs(up[x] - down[x]) + abs(lap_v);
+		int h = (2 * (c[x - 1] + c[x + 1]) + lap_h + 2) >> 2;
+		int v = (2 * (up[x] + down[x]) + lap_v + 2) >> 2;
+		int hv = (2 * (c[x - 1] + c[x + 1] + up[x] + down[x]) +
+			  lap_h + lap_v + 4) >> 3;
+		int value = grad_h < grad_v ? h : grad_v < grad_h ? v : hv;
+
+		green[x] = (x + phase) & 1 ? c[x] : demosaic_clamp(value);
+	}
+}
+
+/*
+ * Green of row sy, interpolated along the direction of the smallest
+ * gradient and corrected by the Laplacian of the own color (Hamilton and
+ * Adams). Valid from x = -1 to width included.
+ */
+static const unsigned char *demosaic_green_row(struct demosaic_lane *lane,
+					       const struct frame *frame,
+					       long sy)
+{
+	int x;
+	int red_row = 0;
+	unsigned int slot = 0;
+	unsigned int phase = 0;
+	unsigned char *green = NULL;
+	const unsigned char *r[5];
+	int width = frame->rect.width;
+
+	sy = demosaic_reflect(sy, frame->height);
+	slot = sy % 3;
+	green = lane->green + slot * (width + 2) + 1;
+	if (lane->green_row[slot] == sy)
+		return green;
+
+	for (x = 0; x < 5; x++)
+		r[x] = demosaic_raw_row(lane, frame, sy + x - 2);
+
+	demosaic_row_phase(frame, sy, &phase, &red_row);
+	demosaic_green_span(r[0], r[1], r[2], r[3], r[4], width, phase,
+			    green);
+
+	lane->green_row[slot] = sy;
+	return green;
+}
+
+/*
+ * Bilinear interpolation of a row in three planes: the own color of the
+ * row (red or blue), green and the other color.
+ */
+static void demosaic_bilinear_row(const unsigned char *up,
+				  const unsigned char *center,
+				  const unsigned char *down,
+				  unsigned int width, unsigned int phase,
+				  unsigned char *own, unsigned char *green,
+				  unsigned char *other)
+{
+	/* Signed, rows are read one pixel before x */
+	int x = 0;
+
+#if defined(__SSE2__)
+	/* Bytes of the pixels on the own color */
+	__m128i mask = _mm_set1_epi16(phase ? (short)0xff00 : 0x00ff);
+
+	for (; x + 16 <= (int)width; x += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(center + x));
+		__m128i h = _mm_avg_epu8(
+			_mm_loadu_si128((const __m128i *)(center + x - 1)),
+			_mm_loadu_si128((const __m128i *)(center + x + 1)));
+		__m128i v = _mm_avg_epu8(
+			_mm_loadu_si128((const __m128i *)(up + x)),
+			_mm_loadu_si128((const __m128i *)(down + x)));
+		__m128i diag = _mm_avg_epu8(
+			_mm_avg_epu8(
+				_mm_loadu_si128((const __m128i *)(up + x - 1)),
+				_mm_loadu_si128((const __m128i *)(up + x + 1))),
+			_mm_avg_epu8(
+				_mm_loadu_si128((const __m128i *)(down + x - 1)),
+				_mm_loadu_si128((const __m128i *)(down + x + 1))));
+		__m128i cross = _mm_avg_epu8(h, v);
+
+		_mm_storeu_si128((__m128i *)(own + x),
+				 _mm_or_si128(_mm_and_si128(mask, c),
+					      _mm_andnot_si128(mask, h)));
+		_mm_storeu_si128((__m128i *)(green + x),
+				 _mm_or_si128(_mm_and_si128(mask, cross),
+					      _mm_andnot_si128(mask, c)));
+		_mm_storeu_si128((__m128i *)(other + x),
+				 _mm_or_si128(_mm_and_si128(mask, diag),
+					      _mm_andnot_si128(mask, v)));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t mask = vreinterpretq_u8_u16(
+		vdupq_n_u16(phase ? 0xff00 : 0x00ff));
+
+	for (; x + 16 <= (int)width; x += 16) {
+		uint8x16_t c = vld1q_u8(center + x);
+		uint8x16_t h = vrhaddq_u8(vld1q_u8(center + x - 1),
+					  vld1q_u8(center + x + 1));
+		uint8x16_t v = vrhaddq_u8(vld1q_u8(up + x),
+					  vld1q_u8(down + x));
+		uint8x16_t diag = vrhaddq_u8(
+			vrhaddq_u8(vld1q_u8(up + x - 1), vld1q_u8(up + x + 1)),
+			vrhaddq_u8(vld1q_u8(down + x - 1),
+				   vld1q_u8(down + x + 1)));
+		uint8x16_t cross = vrhaddq_u8(h, v);
+
+		vst1q_u8(own + x, vbslq_u8(mask, c, h));
+		vst1q_u8(green + x, vbslq_u8(mask, cross, c));
+		vst1q_u8(other + x, vbslq_u8(mask, diag, v));
+	}
+#endif
+
+	for (; x < (int)width; x++) {
+		unsigned int h = AVG(center[x - 1], center[x + 1]);
+		unsigned int v = AVG(up[x], down[x]);
+
+		if ((x + phase) & 1) {
+			own[x] = h;
+			green[x] = center[x];
+			other[x] = v;
+		} else {
+			own[x] = center[x];
+			green[x] = AVG(h, v);
+			other[x] = AVG(AVG(up[x - 1], up[x + 1]),
+				       AVG(down[x - 1], down[x + 1]));
+		}
+	}
+}
+
+/*
+ * Red and blue from the color differences to the interpolated green. As for
+ * the green, both cases of the pattern are computed for every pixel, then
+ * selected with masks: a conditional would be turned back into a branch.
+ */
+static void demosaic_edge_row(const unsigned char *restrict up,
+			      const unsigned char *restrict center,
+			      const unsigned char *restrict down,
+			      const unsigned char *restrict green_up,
+			      const unsigned char *restrict green_center,
+			      const unsigned char *restrict green_down,
+			      unsigned int width, unsigned int phase,
+			      unsigned char *restrict own,
+			      unsigned char *restrict green,
+			      unsigned char *restrict other)
+{
+	int x;
+
+	for (x = 0; x < (int)width; x++) {
+		int g = green_center[x];
+		int raw = center[x];
+		int odd = (x + phase) & 1;
+		int side = g + ((center[x - 1] - green_center[x - 1] +
+				 center[x + 1] - green_center[x + 1] + 1) >> 1);
+		int vertical = g + ((up[x] - green_up[x] +
+				     down[x] - green_down[x] + 1) >> 1);
+		int diagonal = g + ((up[x - 1] - green_up[x - 1] +
+				     up[x + 1] - green_up[x + 1] +
+				     down[x - 1] - green_down[x - 1] +
+				     down[x + 1] - green_down[x + 1] + 2) >> 2);
+
+		side = demosaic_clamp(side);
+		vertical = demosaic_clamp(vertical);
+		diagonal = demosaic_clamp(diagonal);
+
+		green[x] = g;
+		own[x] = (side & -odd) | (raw & (odd - 1));
+		other[x] = (vertical & -odd) | (diagonal & (odd - 1));
+	}
+}
+
+/* Row y of the frame region, demosaiced to RGB24 */
+static void demosaic_row(struct demosaic_lane *lane,
+			 const struct frame *frame, unsigned int y,
+			 unsigned char *rgb)
+{
+	unsigned int x;
+	int red_row = 0;
+	unsigned int phase = 0;
+	unsigned int width = frame->rect.width;
+	long sy = frame->rect.top + y;
+	unsigned char *own = lane->planes;
+	unsigned char *green = own + width;
+	unsigned char *other = green + width;
+	const unsigned char *red = NULL;
+	const unsigned char *blue = NULL;
+
+	demosaic_row_phase(frame, sy, &phase, &red_row);
+
+	if (lane->pool->method == DEMOSAIC_EDGE) {
+		/* Green first, it may evict raw rows from the lane */
+		const unsigned char *green_up =
+			demosaic_green_row(lane, frame, sy - 1);
+		const unsigned char *green_center =
+			demosaic_green_row(lane, frame, sy);
+		const unsigned char *green_down =
+			demosaic_green_row(lane, frame, sy + 1);
+
+		demosaic_edge_row(demosaic_raw_row(lane, frame, sy - 1),
+				  demosaic_raw_row(lane, frame, sy),
+				  demosaic_raw_row(lane, frame, sy + 1),
+				  green_up, green_center, green_down,
+				  width, phase, own, green, other);
+	} else {
+		demosaic_bilinear_row(demosaic_raw_row(lane, frame, sy - 1),
+				      demosaic_raw_row(lane, frame, sy),
+				      demosaic_raw_row(lane, frame, sy + 1),
+				      width, phase, own, green, other);
+	}
+
+	red = red_row ? own : other;
+	blue = red_row ? other : own;
+	for (x = 0; x < width; x++, rgb += 3) {
+		rgb[0] = red[x];
+		rgb[1] = green[x];
+		rgb[2] = blue[x];
+	}
+}
+
+/* Rows of band 'index' of the frame, converted with the lane of the band */
+static void demosaic_band(struct demosaic *demosaic, unsigned int index,
+			  unsigned int bands, const struct frame *frame,
+			  unsigned char *dst)
+{
+	unsigned int y;
+	unsigned int height = frame->rect.height;
+	unsigned int first = (unsigned long long)height * index / bands;
+	unsigned int last = (unsigned long long)height * (index + 1) / bands;
+	size_t row_size = (size_t)frame->rect.width * 3;
+
+	for (y = first; y < last; y++)
+		demosaic_row(&demosaic->lanes[index], frame, y,
+			     dst + y * row_size);
+}
+
+static void *demosaic_worker(void *arg)
+{
+	struct demosaic_lane *lane = arg;
+	struct demosaic *demosaic = lane->pool;
+	unsigned int index = lane - demosaic->lanes;
+	unsigned long generation = 0;
+
+	pthread_mutex_lock(&demosaic->lock);
+	for (;;) {
+		while (!demosaic->quit && demosaic->generation == generation)
+			pthread_cond_wait(&demosaic->wake, &demosaic->lock);
+		if (demosaic->quit)
+			break;
+
+		generation = demosaic->generation;
+		pthread_mutex_unlock(&demosaic->lock);
+
+		demosaic_band(demosaic, index, demosaic->started + 1,
+			      demosaic->frame, demosaic->dst);
+
+		pthread_mutex_lock(&demosaic->lock);
+		if (!--demosaic->pending)
+			pthread_cond_signal(&demosaic->done);
+	}
+	pthread_mutex_unlock(&demosaic->lock);
+
+	return NULL;
+}
+
+/* Demosaic the whole frame, split in bands between the threads */
+static void demosaic_run(struct demosaic *demosaic, const struct frame *frame,
+			 unsigned char *dst)
+{
+	pthread_mutex_lock(&demosaic->lock);
+	demosaic->frame = frame;
+	demosaic->dst = dst;
+	demosaic->pending = demosaic->started;
+	demosaic->generation++;
+	pthread_cond_broadcast(&demosaic->wake);
+	pthread_mutex_unlock(&demosaic->lock);
+
+	demosaic_band(demosaic, 0, demosaic->started + 1, frame, dst);
+
+	pthread_mutex_lock(&demosaic->lock);
+	while (demosaic->pending)
+		pthread_cond_wait(&demosaic->done, &demosaic->lock);
+	pthread_mutex_unlock(&demosaic->lock);
+}
+
+static int demosaic_begin(struct demosaic *demosaic, const struct frame *frame)
+{
+	unsigned int i;
+
+	for (i = 0; i <= demosaic->started; i++)
+		if (demosaic_lane_begin(&demosaic->lanes[i], frame))
+			return -1;
+
+	return 0;
+}
+
+static void demosaic_free(struct demosaic *demosaic)
+{
+	unsigned int i;
+
+	if (!demosaic)
+		return;
+
+	pthread_mutex_lock(&demosaic->lock);
+	demosaic->quit = 1;
+	pthread_cond_broadcast(&demosaic->wake);
+	pthread_mutex_unlock(&demosaic->lock);
+
+	for (i = 0; i < demosaic->started; i++)
+		pthread_join(demosaic->workers[i], NULL);
+
+	for (i = 0; demosaic->lanes && i < demosaic->threads; i++)
+		demosaic_lane_free(&demosaic->lanes[i]);
+
+	pthread_mutex_destroy(&demosaic->lock);
+	pthread_cond_destroy(&demosaic->wake);
+	pthread_cond_destroy(&demosaic->done);
+	free(demosaic->workers);
+	free(demosaic->lanes);
+	free(demosaic);
+}
+
+/* Lanes and worker threads, the caller's thread handles the first band */
+static struct demosaic *demosaic_new(int method, unsigned int threads)
+{
+	unsigned int i;
+	struct demosaic *demosaic = calloc(1, sizeof(*demosaic));
+
+	if (!demosaic)
+		return NULL;
+
+	demosaic->method = method;
+	demosaic->threads = threads;
+	pthread_mutex_init(&demosaic->lock, NULL);
+	pthread_cond_init(&demosaic->wake, NULL);
+	pthread_cond_init(&demosaic->done, NULL);
+
+	demosaic->lanes = calloc(threads, sizeof(*demosaic->lanes));
+	demosaic->workers = calloc(threads, sizeof(*demosaic->workers));
+	if (!demosaic->lanes || !demosaic->workers) {
+		demosaic_free(demosaic);
+		return NULL;
+	}
+
+	for (i = 0; i < threads; i++)
+		demosaic->lanes[i].pool = demosaic;
+
+	/* Fewer bands if the system refuses more threads */
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&demosaic->workers[demosaic->started], NULL,
+				   demosaic_worker, &demosaic->lanes[i]))
+			break;
+		demosaic->started++;
+	}
+
+	return demosaic;
+}
+
+static void frame_copy_planar(const struct frame *frame, unsigned char *dst)
+{
+	unsigned int y;
+	unsigned int plane;
+	unsigned int stride = frame->stride;
+	unsigned int width = frame->rect.width;
+	unsigned int height = frame->rect.height;
+	const unsigned char *src = frame->data + frame->rect.top * stride +
+		frame->rect.left;
+
+	for (y = 0; y < height; y++, dst += width) {
+		memcpy(dst, src + y * stride, width);
+		frame_emit_row(frame, dst, y);
+	}
+
+	/* Chroma planes are subsampled by two in both directions */
+	for (plane = 0; plane < 2; plane++) {
+		src = frame->data + frame->height * frame->stride +
+			plane * (frame->height / 2) * (stride / 2) +
+			(frame->rect.top / 2) * (stride / 2) +
+			frame->rect.left / 2;
+
+		for (y = 0; y < height / 2; y++, dst += width / 2)
+			memcpy(dst, src + y * (stride / 2), width / 2);
+	}
+}
+
+/* Row y of the frame region in the output format */
+static void frame_convert_row(const struct frame *frame, unsigned int y,
+			      unsigned char *dst)
+{
+	if (frame->bayer)
+		demosaic_row(frame->bayer, frame, y, dst);
+	else if (fourcc_depth(frame->fourcc))
+		frame_unpack_row(frame, y, dst);
+	else
+		convert_yuyv_rgb_row(frame_row(frame, y), dst,
+				     frame->rect.width);
+}
+
+static void frame_convert(const struct frame *frame, unsigned char *dst)
+{
+	unsigned int y;
+	unsigned int width = frame->rect.width;
+	unsigned int src_bpp = fourcc_bpp(frame->fourcc);
+	unsigned int dst_bpp = fourcc_bpp(frame_output_fourcc(frame));
+
+	if (frame_is_planar(frame)) {
+		frame_copy_planar(frame, dst);
+		return;
+	}
+
+	if (frame_is_compressed(frame)) {
+		memcpy(dst, frame->data, frame->size);
+		return;
+	}
+
+	if (frame->bayer && frame->bayer->pool->started) {
+		demosaic_run(frame->bayer->pool, frame, dst);
+
+		for (y = 0; y < frame->rect.height; y++)
+			frame_emit_row(frame, dst + y * width * dst_bpp, y);
+		return;
+	}
+
+	for (y = 0; y < frame->rect.height; y++, dst += width * dst_bpp) {
+		if (frame->fourcc == frame_output_fourcc(frame))
+			memcpy(dst, frame_row(frame, y), width * src_bpp);
+		else
+			frame_convert_row(frame, y, dst);
+
+		frame_emit_row(frame, dst, y);
+	}
+}
+
+/* Row y of the frame in the output format, converted in 'scratch' if needed */
+static const unsigned char *frame_fetch_row(const struct frame *frame,
+					    unsigned int y,
+					    unsigned char *scratch)
+{
+	const unsigned char *row = scratch;
+
+	if (frame->fourcc == frame_output_fourcc(frame))
+		row = frame_row(frame, y);
+	else
+		frame_convert_row(frame, y, scratch);
+
+	frame_emit_row(frame, row, y);
+	return row;
+}
+
+/*
+ * Downscaling and rotation
+ *
+ * The scaler pulls the rows it needs from the frame, converting them one at
+ * a time, so no full resolution intermediate image is ever written. The box
+ * filter first sums its source rows column by column, a loop over whole rows
+ * the compiler vectorizes, then adds up the columns of each output pixel.
+ * The bilinear filter gathers two columns per output pixel, in scalar loops
+ * specialized for the pixel size.
+ */
+#define SCALE_BOX	0
+#define SCALE_BILINEAR	1
+
+struct scaler {
+	unsigned int width;
+	unsigned int height;
+	int rotation;
+	int filter;
+	/* Tables below are computed for this source width and pixel size */
+	unsigned int src_width;
+	unsigned int channels;
+	unsigned int *x0;
+	unsigned int *x1;
+	/* Box filter sums of each source column */
+	unsigned int *acc;
+	unsigned char *rows[3];
+};
+
+static void scaler_free_tables(struct scaler *scaler)
+{
+	free(scaler->x0);
+	free(scaler->acc);
+	free(scaler->rows[0]);
+	scaler->x0 = NULL;
+	scaler->acc = NULL;
+	scaler->rows[0] = NULL;
+	scaler->src_width = 0;
+}
+
+static void scaler_free(struct scaler *scaler)
+{
+	if (!scaler)
+		return;
+
+	scaler_free_tables(scaler);
+	free(scaler);
+}
+
+static unsigned int scaler_channels(const struct frame *frame)
+{
+	switch (frame_output_fourcc(frame)) {
+	case V4L2_PIX_FMT_GREY:
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_BGR32:
+		return fourcc_bpp(frame_output_fourcc(frame));
+	default:
+		return 0;
+	}
+}
+
+static int scaler_prepare(struct scaler *scaler, const struct frame *frame)
+{
+	unsigned int x;
+	unsigned int channels = scaler_channels(frame);
+	unsigned int src_width = frame->rect.width;
+	size_t row_size = 0;
+
+	if (!channels) {
+		PyErr_SetString(PyExc_ValueError, "Scaling needs a packed RGB "
+				"or grey output format");
+		return -1;
+	}
+
+	if (scaler->src_width == src_width && scaler->channels == channels)
+		return 0;
+
+	scaler_free_tables(scaler);
+
+	row_size = (size_t)(src_width + 1) * channels;
+	scaler->x0 = malloc(2 * scaler->width * sizeof(unsigned int));
+	scaler->acc = malloc((size_t)src_width * channels *
+			     sizeof(unsigned int));
+	scaler->rows[0] = malloc(2 * row_size + scaler->width * channels);
+
+	if (!scaler->x0 || !scaler->acc || !scaler->rows[0]) {
+		scaler_free_tables(scaler);
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	scaler->x1 = scaler->x0 + scaler->width;
+	scaler->rows[1] = scaler->rows[0] + row_size;
+	scaler->rows[2] = scaler->rows[1] + row_size;
+
+	for (x = 0; x < scaler->width; x++) {
+		if (scaler->filter == SCALE_BOX) {
+			/* Source columns [x0, x1) fall in output column x */
+			scaler->x0[x] = (size_t)x * src_width / scaler->width;
+			scaler->x1[x] = (size_t)(x + 1) * src_width /
+				scaler->width;
+			if (scaler->x1[x] <= scaler->x0[x])
+				scaler->x1[x] = scaler->x0[x] + 1;
+		} else {
+			/* Left column and weight of the right one, 8.8 */
+			long pos = ((2 * x + 1) * 256L * src_width /
+				    scaler->width - 256) / 2;
+
+			if (pos < 0)
+				pos = 0;
+			if (pos >= (src_width - 1) * 256L)
+				pos = (src_width - 1) * 256L - 1;
+			if (src_width == 1)
+				pos = 0;
+			scaler->x0[x] = pos >> 8;
+			scaler->x1[x] = pos & 0xFF;
+		}
+	}
+
+	scaler->src_width = src_width;
+	scaler->channels = channels;
+
+	return 0;
+}
+
+/* Widening adds over the whole row, vectorized */
+static void scaler_box_add(unsigned int *restrict acc,
+			   const unsigned char *restrict row, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		acc[i] += row[i];
+}
+
+/* Output pixels from the column sums, 'channels' being a constant once
+ * inlined */
+static inline void scaler_box_reduce(const struct scaler *scaler,
+				     unsigned int rows, unsigned char *out,
+				     const unsigned int channels)
+{
+	unsigned int x;
+	unsigned int c;
+	unsigned int i;
+
+	for (x = 0; x < scaler->width; x++, out += channels) {
+		const unsigned int *acc = scaler->acc +
+			scaler->x0[x] * channels;
+		unsigned int area = (scaler->x1[x] - scaler->x0[x]) * rows;
+		unsigned int sums[4] = { 0, 0, 0, 0 };
+
+		for (i = scaler->x0[x]; i < scaler->x1[x]; i++)
+			for (c = 0; c < channels; c++)
+				sums[c] += *acc++;
+
+		/* Exact, a rounded reciprocal overflows white boxes */
+		for (c = 0; c < channels; c++)
+			out[c] = (sums[c] + area / 2) / area;
+	}
+}
+
+static void scaler_box_row(struct scaler *scaler, const struct frame *frame,
+			   unsigned int y, unsigned char *out)
+{
+	unsigned int src_height = frame->rect.height;
+	unsigned int y0 = (size_t)y * src_height / scaler->height;
+	unsigned int y1 = (size_t)(y + 1) * src_height / scaler->height;
+	size_t count = (size_t)scaler->src_width * scaler->channels;
+
+	if (y1 <= y0)
+		y1 = y0 + 1;
+
+	memset(scaler->acc, 0, count * sizeof(unsigned int));
+
+	for (y = y0; y < y1; y++)
+		scaler_box_add(scaler->acc, frame_fetch_row(frame, y,
+							    scaler->rows[0]),
+			       count);
+
+	switch (scaler->channels) {
+	case 1:
+		scaler_box_reduce(scaler, y1 - y0, out, 1);
+		break;
+	case 3:
+		scaler_box_reduce(scaler, y1 - y0, out, 3);
+		break;
+	default:
+		scaler_box_reduce(scaler, y1 - y0, out, 4);
+		break;
+	}
+}
+
+/*
+ * The bilinear filter skips source rows when downscaling, the statistics get
+ * them anyway so that they describe the whole image: rows up to 'end'.
+ */
+static void scaler_stats_rows(struct scaler *scaler, const struct frame *frame,
+			      unsigned int end)
+{
+	unsigned int y;
+
+	if (!frame->stats || !frame->stats->valid)
+		return;
+
+	for (y = frame->stats->last_row + 1; y < end; y++)
+		frame_fetch_row(frame, y, scaler->rows[0]);
+}
+
+/* One output row from two source rows, 'channels' being a constant once
+ * inlined */
+static inline void scaler_bilinear_blend(const struct scaler *scaler,
+					 const unsigned char *row0,
+					 const unsigned char *row1,
+					 unsigned int wy, unsigned char *out,
+					 const unsigned int channels)
+{
+	unsigned int x;
+	unsigned int c;
+	unsigned int right = scaler->src_width > 1 ? channels : 0;
+
+	for (x = 0; x < scaler->width; x++, out += channels) {
+		unsigned int wx = scaler->x1[x];
+		const unsigned char *p0 = row0 + scaler->x0[x] * channels;
+		const unsigned char *p1 = row1 + scaler->x0[x] * channels;
+
+		for (c = 0; c < channels; c++) {
+			unsigned int top = p0[c] * (256 - wx) +
+				p0[c + right] * wx;
+			unsigned int bottom = p1[c] * (256 - wx) +
+				p1[c + right] * wx;
+
+			out[c] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+		}
+	}
+}
+
+static void scaler_bilinear_row(struct scaler *scaler,
+				const struct frame *frame, unsigned int y,
+				unsigned char *out)
+{
+	unsigned int wy;
+	unsigned int src_height = frame->rect.height;
+	long pos = ((2 * y + 1) * 256L * src_height / scaler->height - 256) / 2;
+	const unsigned char *row0;
+	const unsigned char *row1;
+
+	if (pos < 0)
+		pos = 0;
+	if (pos >= (src_height - 1) * 256L)
+		pos = src_height > 1 ? (src_height - 1) * 256L - 1 : 0;
+
+	wy = pos & 0xFF;
+	scaler_stats_rows(scaler, frame, pos >> 8);
+	row0 = frame_fetch_row(frame, pos >> 8, scaler->rows[0]);
+	row1 = row0;
+	if (src_height > 1)
+		row1 = frame_fetch_row(frame, (pos >> 8) + 1, scaler->rows[1]);
+
+	switch (scaler->channels) {
+	case 1:
+		scaler_bilinear_blend(scaler, row0, row1, wy, out, 1);
+		break;
+	case 3:
+		scaler_bilinear_blend(scaler, row0, row1, wy, out, 3);
+		break;
+	default:
+		scaler_bilinear_blend(scaler, row0, row1, wy, out, 4);
+		break;
+	}
+}
+
+/* Size of the scaled image, after rotation */
+static void scaler_output_size(const struct scaler *scaler,
+			       unsigned int *width, unsigned int *height)
+{
+	int swap = scaler->rotation == 90 || scaler->rotation == 270;
+
+	*width = swap ? scaler->height : scaler->width;
+	*height = swap ? scaler->width : scaler->height;
+}
+
+/* Store scaled row y, rotated counterclockwise like PIL's Image.rotate */
+static void scaler_store_row(const struct scaler *scaler, unsigned int y,
+			     const unsigned char *row, unsigned char *dst)
+{
+	unsigned int x;
+	unsigned int out_width;
+	unsigned int out_height;
+	unsigned int channels = scaler->channels;
+	unsigned char *pixel = NULL;
+	long step = 0;
+
+	scaler_output_size(scaler, &out_width, &out_height);
+
+	switch (scaler->rotation) {
+	case 90:
+		/* (x, y) -> (y, width - 1 - x) */
+		pixel = dst + ((size_t)(out_height - 1) * out_width + y) *
+			channels;
+		step = -(long)out_width * channels;
+		break;
+	case 180:
+		pixel = dst + ((size_t)(out_height - 1 - y) * out_width +
+			       out_width - 1) * channels;
+		step = -(long)channels;
+		break;
+	case 270:
+		/* (x, y) -> (height - 1 - y, x) */
+		pixel = dst + (size_t)(out_width - 1 - y) * channels;
+		step = (long)out_width * channels;
+		break;
+	default:
+		memcpy(dst + (size_t)y * out_width * channels, row,
+		       out_width * channels);
+		return;
+	}
+
+	for (x = 0; x < scaler->width; x++, pixel += step, row += channels)
+		memcpy(pixel, row, channels);
+}
+
+static int scaler_run(struct scaler *scaler, const struct frame *frame,
+		      unsigned char *dst)
+{
+	unsigned int y;
+	unsigned char *row = NULL;
+
+	if (scaler_prepare(scaler, frame))
+		return -1;
+
+	row = scaler->rows[2];
+	for (y = 0; y < scaler->height; y++) {
+		if (scaler->filter == SCALE_BOX)
+			scaler_box_row(scaler, frame, y, row);
+		else
+			scaler_bilinear_row(scaler, frame, y, row);
+
+		scaler_store_row(scaler, y, row, dst);
+	}
+
+	if (scaler->filter == SCALE_BILINEAR)
+		scaler_stats_rows(scaler, frame, frame->rect.height);
+
+	return 0;
+}
+
+/*
+ * Motion gating
+ *
+ * A subsampled luma grid of each candidate frame is compared with the one
+ * of the last delivered frame, before any conversion. Frames that barely
+ * changed are given back to the driver.
+ */
+struct motion_gate {
+	unsigned int step;
+	double threshold;
+	double heartbeat;
+	double last_delivered;
+	double score;
+	unsigned int width;
+	unsigned int height;
+	int has_reference;
+	unsigned char *reference;
+	unsigned char *current;
+};
+
+static void motion_gate_free(struct motion_gate *gate)
+{
+	if (!gate)
+		return;
+
+	free(gate->reference);
+	free(gate->current);
+	free(gate);
+}
+
+/* Sum of absolute differences */
+static unsigned long sad_u8(const unsigned char *a, const unsigned char *b,
+			    size_t len)
+{
+	size_t i = 0;
+	unsigned long sum = 0;
+
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(
+			_mm_loadu_si128((const __m128i *)(a + i)),
+			_mm_loadu_si128((const __m128i *)(b + i))));
+
+	sum = (unsigned int)_mm_cvtsi128_si32(acc) +
+		(unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(__ARM_NEON)
+	uint32x4_t acc = vdupq_n_u32(0);
+
+	for (; i + 16 <= len; i += 16)
+		acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i),
+							 vld1q_u8(b + i))));
+
+	sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+		vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+	for (; i < len; i++)
+		sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+	return sum;
+}
+
+/*
+ * Where to find the luma of a pixel: byte 'offset' of each 'bpp' bytes,
+ * or an approximation from the three color bytes when 'rgb' is set.
+ * Returns -1 for formats without usable luma (compressed).
+ */
+static int fourcc_luma(__u32 fourcc, unsigned int *offset,
+		       unsigned int *bpp, int *rgb)
+{
+	*offset = 0;
+	*bpp = fourcc_bpp(fourcc);
+	*rgb = 0;
+
+	switch (fourcc) {
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		*bpp = 1;
+		return 0;
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_VYUY:
+	case V4L2_PIX_FMT_Y16:
+		*offset = 1;
+		return 0;
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+	case V4L2_PIX_FMT_RGB32:
+	case V4L2_PIX_FMT_BGR32:
+		*rgb = 1;
+		return 0;
+	case V4L2_PIX_FMT_RGB565:
+	case V4L2_PIX_FMT_Y10:
+	case V4L2_PIX_FMT_Y12:
+		return -1;
+	default:
+		return *bpp ? 0 : -1;
+	}
+}
+
+/* Luma plane row y of the frame region (also valid for planar formats) */
+static const unsigned char *frame_luma_row(const struct frame *frame,
+					   unsigned int y)
+{
+	if (frame_is_planar(frame))
+		return frame->data + (frame->rect.top + y) * frame->stride +
+			frame->rect.left;
+
+	return frame_row(frame, y);
+}
+
+static int motion_gate_sample(struct motion_gate *gate,
+			      const struct frame *frame)
+{
+	int rgb = 0;
+	unsigned int x;
+	unsigned int y;
+	unsigned int bpp = 0;
+	unsigned int offset = 0;
+	unsigned int step = gate->step;
+	unsigned int width = (frame->rect.width + step - 1) / step;
+	unsigned int height = (frame->rect.height + step - 1) / step;
+	unsigned char *out = NULL;
+
+	if (fourcc_luma(frame->fourcc, &offset, &bpp, &rgb))
+		return -1;
+
+	if (width != gate->width || height != gate->height) {
+		free(gate->reference);
+		free(gate->current);
+		gate->reference = malloc(width * height);
+		gate->current = malloc(width * height);
+		gate->width = width;
+		gate->height = height;
+		gate->has_reference = 0;
+
+		if (!gate->reference || !gate->current) {
+			gate->width = 0;
+			return -1;
+		}
+	}
+
+	out = gate->current;
+	for (y = 0; y < height; y++) {
+		const unsigned char *row = frame_luma_row(frame, y * step);
+		const unsigned char *pixel = row + offset;
+		size_t inc = (size_t)step * bpp;
+
+		if (rgb) {
+			for (x = 0; x < width; x++, pixel += inc)
+				*out++ = (pixel[0] + 2 * pixel[1] +
+					  pixel[2]) >> 2;
+		} else {
+			for (x = 0; x < width; x++, pixel += inc)
+				*out++ = *pixel;
+		}
+	}
+
+	return 0;
+}
+
+/* Tell if the frame changed enough, or is due as a heartbeat */
+static int motion_gate_accept(struct motion_gate *gate,
+			      const struct frame *frame, double timestamp)
+{
+	unsigned char *swap = NULL;
+	size_t len = 0;
+
+	/* Frames that can not be sampled are always delivered */
+	if (motion_gate_sample(gate, frame))
+		return 1;
+
+	len = (size_t)gate->width * gate->height;
+	if (gate->has_reference) {
+		gate->score = (double)sad_u8(gate->current, gate->reference,
+					     len) / len;
+
+		if (gate->score < gate->threshold &&
+		    (gate->heartbeat <= 0 ||
+		     timestamp - gate->last_delivered < gate->heartbeat))
+			return 0;
+	}
+
+	swap = gate->reference;
+	gate->reference = gate->current;
+	gate->current = swap;
+	gate->has_reference = 1;
+	gate->last_delivered = timestamp;
+
+	return 1;
+}
+
+static int video_device_refresh_format(video_device *videodev)
+{
+	struct v4l2_format format;
+
+	CLEAR(format);
+	format.type = videodev->type;
+
+	if (video_device_ioctl(videodev, VIDIOC_G_FMT, &format)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+
+	videodev->pix = format.fmt.pix;
+	return 0;
+}
+
+/* Lane of the calling thread when the format is demosaiced */
+static struct demosaic_lane *video_device_bayer(video_device *videodev,
+					       __u32 fourcc)
+{
+	unsigned int red_x = 0;
+	unsigned int red_y = 0;
+
+	if (!videodev->demosaic || fourcc_bayer(fourcc, &red_x, &red_y))
+		return NULL;
+
+	return videodev->demosaic->lanes;
+}
+
+static int video_device_frame(video_device *videodev,
+			      struct v4l2_buffer *buffer,
+			      struct frame *frame)
+{
+	struct v4l2_pix_format *pix = &videodev->pix;
+
+	frame->data = videodev->buffers[buffer->index].start;
+	frame->fourcc = pix->pixelformat;
+	frame->width = pix->width;
+	frame->height = pix->height;
+	frame->stride = pix->bytesperline;
+	if (!frame->stride)
+		frame->stride = fourcc_row_bytes(pix->pixelformat,
+						 pix->width);
+
+	/* Compressed frames are as long as the driver says */
+	frame->size = videodev->buffers[buffer->index].length;
+	if (frame_is_compressed(frame))
+		frame->size = buffer->bytesused;
+
+	frame->stats = NULL;
+	frame->bayer = video_device_bayer(videodev, frame->fourcc);
+	frame->to_8bit = videodev->depth == 8;
+
+	if (videodev->crop.width) {
+		frame->rect = videodev->crop;
+	} else {
+		frame->rect.left = 0;
+		frame->rect.top = 0;
+		frame->rect.width = pix->width;
+		frame->rect.height = pix->height;
+	}
+
+	return frame_check(frame);
+}
+
+static double timeval2sec(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/* Decimation: tell if a dequeued frame has to be delivered */
+static int video_device_accept(video_device *videodev,
+			       struct v4l2_buffer *buffer)
+{
+	double timestamp = timeval2sec(&buffer->timestamp);
+	double period = timestamp - videodev->last_timestamp;
+
+	videodev->last_timestamp = timestamp;
+
+	if (videodev->decimate > 1 &&
+	    videodev->decimate_count++ % videodev->decimate)
+		return 0;
+
+	if (videodev->interval <= 0)
+		return 1;
+
+	/* Deliver the frame nearest to the due time, half a frame period
+	 * early is closer than half a period late */
+	if (period <= 0 || period > videodev->interval)
+		period = 0;
+
+	if (timestamp < videodev->next_due - period / 2)
+		return 0;
+
+	videodev->next_due += videodev->interval;
+	if (videodev->next_due <= timestamp)
+		videodev->next_due = timestamp + videodev->interval;
+
+	return 1;
+}
+
+/*
+ * Shared memory frame ring
+ *
+ * The publisher converts each delivered frame straight into a slot of a
+ * memfd backed ring, subscribers in other processes map the same memfd and
+ * read the frames in place. A slot reference count protects the frames
+ * being read: the publisher only takes slots nobody references, setting
+ * SHM_SLOT_WRITER while it fills them, and skips the others.
+ */
+#define SHM_RING_MAGIC		0x324c3456	/* "V4L2" */
+#define SHM_RING_VERSION	1
+#define SHM_SLOT_WRITER		0x80000000u
+#define SHM_SLOT_HEADER		64
+
+struct shm_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t notify;
+	uint64_t slot_size;
+	uint64_t slot_stride;
+	uint64_t data_offset;
+	uint64_t write_seq;
+};
+
+struct shm_ring_slot {
+	uint64_t seq;
+	uint32_t refcount;
+	uint32_t fourcc;
+	uint64_t length;
+	uint32_t width;
+	uint32_t height;
+	double timestamp;
+};
+
+struct shm_ring {
+	int fd;
+	size_t size;
+	struct shm_ring_header *header;
+	uint64_t seq;
+	unsigned long dropped;
+};
+
+static struct shm_ring_slot *shm_ring_slot(struct shm_ring_header *header,
+					   uint64_t seq)
+{
+	return (struct shm_ring_slot *)((unsigned char *)header +
+					header->data_offset +
+					(seq % header->slot_count) *
+					header->slot_stride);
+}
+
+static void shm_ring_free(struct shm_ring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->header)
+		munmap(ring->header, ring->size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+}
+
+static struct shm_ring *shm_ring_create(unsigned int slot_count,
+					size_t slot_size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct shm_ring *ring = calloc(1, sizeof(*ring));
+	struct shm_ring_header *header = NULL;
+
+	if (!ring) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	ring->fd = memfd_create("pyv4l2-ring", MFD_CLOEXEC |
+				MFD_ALLOW_SEALING);
+	if (ring->fd < 0)
+		goto error;
+
+	/* Slots are page aligned, so they can be mapped on their own */
+	slot_size = (slot_size + SHM_SLOT_HEADER + page - 1) / page * page;
+	ring->size = page + slot_count * slot_size;
+
+	if (ftruncate(ring->fd, ring->size) ||
+	    fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		  F_SEAL_SEAL))
+		goto error;
+
+	header = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      ring->fd, 0);
+	if (header == MAP_FAILED)
+		goto error;
+
+	header->magic = SHM_RING_MAGIC;
+	header->version = SHM_RING_VERSION;
+	header->slot_count = slot_count;
+	header->slot_stride = slot_size;
+	header->slot_size = slot_size - SHM_SLOT_HEADER;
+	header->data_offset = page;
+	ring->header = header;
+
+	return ring;
+
+error:
+	PyErr_SetFromErrno(PyExc_IOError);
+	shm_ring_free(ring);
+	return NULL;
+}
+
+/* Take the next free slot for a frame, NULL if none can hold it */
+static struct shm_ring_slot *shm_ring_begin(struct shm_ring *ring,
+					    size_t length)
+{
+	unsigned int i;
+	uint32_t unused = 0;
+	struct shm_ring_slot *slot = NULL;
+
+	if (length > ring->header->slot_size) {
+		ring->dropped++;
+		return NULL;
+	}
+
+	for (i = 0; i < ring->header->slot_count; i++) {
+		slot = shm_ring_slot(ring->header, ring->seq + 1 + i);
+		unused = 0;
+
+		if (__atomic_compare_exchange_n(&slot->refcount, &unused,
+						SHM_SLOT_WRITER, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			ring->seq += i;
+			return slot;
+		}
+	}
+
+	ring->dropped++;
+	return NULL;
+}
+
+static void shm_ring_commit(struct shm_ring *ring,
+			    struct shm_ring_slot *slot,
+			    const struct frame *frame, size_t length,
+			    double timestamp, int scaled_x, int scaled_y)
+{
+	uint64_t seq = ++ring->seq;
+
+	slot->fourcc = frame_output_fourcc(frame);
+	slot->width = scaled_x;
+	slot->height = scaled_y;
+	slot->length = length;
+	slot->timestamp = timestamp;
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->refcount, 0, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&ring->header->write_seq, seq, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&ring->header->notify, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &ring->header->notify, FUTEX_WAKE, INT_MAX,
+		NULL, NULL, 0);
+}
+
+/* Give a slot back untouched */
+static void shm_ring_abort(struct shm_ring_slot *slot)
+{
+	__atomic_store_n(&slot->refcount, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Capture files
+ *
+ * A raw stream as dequeued, in host byte order: a header describing the
+ * format, then one record per frame. Each 64 bytes record header sits just
+ * before its frame data, which starts on a page boundary, so a replay maps
+ * the file and delivers the frames in place. Records are appended as they
+ * come and a truncated file is still valid up to its last complete record.
+ */
+#define CAPTURE_MAGIC		"PYV4L2CF"
+#define CAPTURE_VERSION		1
+#define CAPTURE_PAGE		4096
+#define CAPTURE_RECORD_MAGIC	0x454d5246	/* "FRME" */
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	/* Alignment of the frame data */
+	uint32_t page_size;
+	uint32_t type;
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bytesperline;
+	uint32_t sizeimage;
+	uint32_t field;
+	uint32_t colorspace;
+};
+
+struct capture_record {
+	uint32_t magic;
+	/* Bytes of frame data following the record */
+	uint32_t length;
+	uint32_t sequence;
+	uint32_t flags;
+	uint32_t field;
+	uint32_t reserved;
+	int64_t tv_sec;
+	int64_t tv_usec;
+	/* Monotonic time of the dequeue, which replays are paced on */
+	double received;
+	uint32_t padding[4];
+};
+
+struct capture_file {
+	int fd;
+	/* Where the next record goes */
+	uint64_t offset;
+	unsigned long long frames;
+	/* errno of the first failed write, nothing is written after it */
+	int error;
+};
+
+static const unsigned char capture_zeros[CAPTURE_PAGE];
+
+/* Offset of the record following frame data ending at 'end' */
+static uint64_t capture_next(uint64_t end, uint32_t page)
+{
+	end += sizeof(struct capture_record);
+	return (end + page - 1) / page * page - sizeof(struct capture_record);
+}
+
+static int write_vector(int fd, struct iovec *iov, int count)
+{
+	ssize_t written = 0;
+
+	while (count) {
+		written = writev(fd, iov, count);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+			return -1;
+
+		/* Resume after a short write */
+		while (count && written >= (ssize_t)iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+static int capture_write_header(struct capture_file *file, uint32_t type,
+				const struct v4l2_pix_format *pix)
+{
+	struct capture_header header;
+	struct iovec iov[2];
+
+	CLEAR(header);
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = CAPTURE_VERSION;
+	header.page_size = CAPTURE_PAGE;
+	header.type = type;
+	header.fourcc = pix->pixelformat;
+	header.width = pix->width;
+	header.height = pix->height;
+	header.bytesperline = pix->bytesperline;
+	header.sizeimage = pix->sizeimage;
+	header.field = pix->field;
+	header.colorspace = pix->colorspace;
+
+	file->offset = capture_next(sizeof(header), CAPTURE_PAGE);
+
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (void *)capture_zeros;
+	iov[1].iov_len = file->offset - sizeof(header);
+
+	if (write_vector(file->fd, iov, 2)) {
+		file->error = errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int capture_write_frame(struct capture_file *file,
+			       const struct capture_record *record,
+			       const void *data)
+{
+	uint64_t end = file->offset + sizeof(*record) + record->length;
+	uint64_t next = capture_next(end, CAPTURE_PAGE);
+	struct iovec iov[3];
+
+	if (file->error)
+		return -1;
+
+	iov[0].iov_base = (void *)record;
+	iov[0].iov_len = sizeof(*record);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = record->length;
+	iov[2].iov_base = (void *)capture_zeros;
+	iov[2].iov_len = next - end;
+
+	if (write_vector(file->fd, iov, 3)) {
+		file->error = errno;
+		return -1;
+	}
+
+	file->offset = next;
+	file->frames++;
+	return 0;
+}
+
+/* Append a dequeued buffer, errors are kept for capture_close */
+static void capture_add(struct capture_file *file,
+			const struct v4l2_buffer *buffer,
+			const void *data, size_t length)
+{
+	struct capture_record record;
+
+	CLEAR(record);
+	record.magic = CAPTURE_RECORD_MAGIC;
+	record.length = length;
+	record.sequence = buffer->sequence;
+	record.flags = buffer->flags;
+	record.field = buffer->field;
+	record.tv_sec = buffer->timestamp.tv_sec;
+	record.tv_usec = buffer->timestamp.tv_usec;
+	record.received = monotonic_now();
+
+	capture_write_frame(file, &record, data);
+}
+
+static struct capture_file *capture_create(const char *path, uint32_t type,
+					   const struct v4l2_pix_format *pix)
+{
+	struct capture_file *file = calloc(1, sizeof(*file));
+
+	if (!file) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (file->fd < 0 || capture_write_header(file, type, pix)) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+		if (file->fd >= 0)
+			close(file->fd);
+		free(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+/* Returns the errno of the first failure, 0 if the file is complete */
+static int capture_close(struct capture_file *file)
+{
+	int error = 0;
+
+	if (!file)
+		return 0;
+
+	error = file->error;
+	if (close(file->fd) && !error)
+		error = errno;
+
+	free(file);
+	return error;
+}
+
+/*
+ * Flight recorder
+ *
+ * Every dequeued buffer is copied as is (MJPG or raw) in a preallocated
+ * arena holding variable size records, the oldest being overwritten. A dump
+ * streams a time window of it to a capture file from its own thread: the record
+ * being written is pinned, and while the dump lags behind, new frames are
+ * dropped from the recorder instead of stalling the capture.
+ */
+#define RECORDER_ALIGN		64
+#define RECORDER_WRAP		0xffffffffu
+
+struct recorder_record {
+	uint32_t size;
+	/* RECORDER_WRAP when the rest of the arena is unused */
+	uint32_t length;
+	uint32_t fourcc;
+	uint32_t width;
+	uint32_t height;
+	uint32_t bytesperline;
+	uint32_t sequence;
+	uint32_t flags;
+	uint32_t field;
+	int64_t tv_sec;
+	int64_t tv_usec;
+	/* Monotonic time of the dequeue, which dump windows refer to */
+	double received;
+};
+
+struct recorder {
+	unsigned char *arena;
+	size_t size;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Oldest record, and where the next one goes */
+	size_t tail;
+	size_t head;
+	unsigned long records;
+	unsigned long long recorded;
+	unsigned long long dropped;
+	/* Dump */
+	pthread_t thread;
+	int thread_started;
+	int dumping;
+	int quit;
+	int pinned;
+	size_t pin;
+	/* Records from the pin on, not dumped yet */
+	unsigned long unread;
+	int fd;
+	uint32_t type;
+	/* Format of the dumped records, the others are skipped */
+	struct v4l2_pix_format pix;
+	double start;
+	double end;
+	unsigned long long dumped;
+	int error;
+};
+
+static struct recorder_record *recorder_at(struct recorder *recorder,
+					   size_t offset)
+{
+	return (struct recorder_record *)(recorder->arena + offset);
+}
+
+/* Offset of the record following the one at 'offset' */
+static size_t recorder_next(struct recorder *recorder, size_t offset)
+{
+	offset += recorder_at(recorder, offset)->size;
+
+	if (offset == recorder->size ||
+	    (offset != recorder->head &&
+	     recorder_at(recorder, offset)->length == RECORDER_WRAP))
+		return 0;
+
+	return offset;
+}
+
+/* Forget the oldest record, unless a dump still needs it */
+static int recorder_evict(struct recorder *recorder)
+{
+	if (recorder->pinned && recorder->unread &&
+	    recorder->pin == recorder->tail)
+		return -1;
+
+	recorder->tail = recorder_next(recorder, recorder->tail);
+	recorder->records--;
+	return 0;
+}
+
+/* Room for a record of 'size' bytes, taken by recorder_commit */
+static int recorder_reserve(struct recorder *recorder, size_t size,
+			    size_t *offset)
+{
+	for (;;) {
+		if (!recorder->records) {
+			if (recorder->pinned)
+				recorder->pin = 0;
+			recorder->head = 0;
+			recorder->tail = 0;
+		}
+
+		if (recorder->head > recorder->tail || !recorder->records) {
+			if (recorder->size - recorder->head >= size) {
+				*offset = recorder->head;
+				return 0;
+			}
+
+			if (recorder->tail >= size) {
+				recorder_at(recorder, recorder->head)->size =
+					recorder->size - recorder->head;
+				recorder_at(recorder, recorder->head)->length =
+					RECORDER_WRAP;
+				if (recorder->pinned &&
+				    recorder->pin == recorder->head)
+					recorder->pin = 0;
+				*offset = 0;
+				return 0;
+			}
+		} else if (recorder->tail - recorder->head >= size) {
+			*offset = recorder->head;
+			return 0;
+		}
+
+		if (recorder_evict(recorder))
+			return -1;
+	}
+}
+
+static void recorder_add(struct recorder *recorder,
+			 const struct v4l2_pix_format *pix,
+			 const struct v4l2_buffer *buffer, const void *data)
+{
+	size_t offset = 0;
+	size_t length = buffer->bytesused ? buffer->bytesused :
+		pix->sizeimage;
+	size_t size = (sizeof(struct recorder_record) + length +
+		       RECORDER_ALIGN - 1) / RECORDER_ALIGN * RECORDER_ALIGN;
+	struct recorder_record *record = NULL;
+
+	pthread_mutex_lock(&recorder->lock);
+	if (size > recorder->size || recorder_reserve(recorder, size, &offset)) {
+		recorder->dropped++;
+		pthread_mutex_unlock(&recorder->lock);
+		return;
+	}
+	pthread_mutex_unlock(&recorder->lock);
+
+	/* The reserved room is neither read nor evicted until committed */
+	record = recorder_at(recorder, offset);
+	record->size = size;
+	record->length = length;
+	record->fourcc = pix->pixelformat;
+	record->width = pix->width;
+	record->height = pix->height;
+	record->bytesperline = pix->bytesperline;
+	record->sequence = buffer->sequence;
+	record->flags = buffer->flags;
+	record->field = buffer->field;
+	record->tv_sec = buffer->timestamp.tv_sec;
+	record->tv_usec = buffer->timestamp.tv_usec;
+	record->received = monotonic_now();
+	memcpy(record + 1, data, length);
+
+	pthread_mutex_lock(&recorder->lock);
+	recorder->head = offset + size == recorder->size ? 0 : offset + size;
+	recorder->records++;
+	recorder->recorded++;
+	if (recorder->pinned)
+		recorder->unread++;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->lock);
+}
+
+static int recorder_write(struct capture_file *file,
+			  const struct v4l2_pix_format *pix,
+			  const struct recorder_record *record)
+{
+	struct capture_record meta;
+
+	if (record->fourcc != pix->pixelformat ||
+	    record->width != pix->width || record->height != pix->height)
+		return 0;
+
+	CLEAR(meta);
+	meta.magic = CAPTURE_RECORD_MAGIC;
+	meta.length = record->length;
+	meta.sequence = record->sequence;
+	meta.flags = record->flags;
+	meta.field = record->field;
+	meta.tv_sec = record->tv_sec;
+	meta.tv_usec = record->tv_usec;
+	meta.received = record->received;
+
+	return capture_write_frame(file, &meta, record + 1) ? -1 : 1;
+}
+
+static void *recorder_dump(void *arg)
+{
+	int written = 0;
+	struct recorder *recorder = arg;
+	struct recorder_record *record = NULL;
+	struct capture_file file;
+	struct timespec deadline;
+
+	deadline.tv_sec = recorder->end;
+	deadline.tv_nsec = (recorder->end - deadline.tv_sec) * 1000000000.0;
+
+	CLEAR(file);
+	file.fd = recorder->fd;
+	capture_write_header(&file, recorder->type, &recorder->pix);
+
+	pthread_mutex_lock(&recorder->lock);
+
+	/* First record of the window */
+	recorder->pin = recorder->tail;
+	recorder->unread = recorder->records;
+	recorder->pinned = 1;
+	while (recorder->unread &&
+	       recorder_at(recorder, recorder->pin)->received <
+	       recorder->start) {
+		recorder->pin = recorder_next(recorder, recorder->pin);
+		recorder->unread--;
+	}
+
+	while (!recorder->quit && !file.error) {
+		if (!recorder->unread) {
+			if (monotonic_now() >= recorder->end)
+				break;
+			pthread_cond_timedwait(&recorder->cond,
+					       &recorder->lock, &deadline);
+			continue;
+		}
+
+		record = recorder_at(recorder, recorder->pin);
+		if (record->received > recorder->end)
+			break;
+
+		pthread_mutex_unlock(&recorder->lock);
+		written = recorder_write(&file, &recorder->pix, record);
+		pthread_mutex_lock(&recorder->lock);
+
+		if (written < 0)
+			break;
+
+		recorder->dumped += written;
+		recorder->pin = recorder_next(recorder, recorder->pin);
+		recorder->unread--;
+	}
+
+	recorder->error = file.error;
+	recorder->pinned = 0;
+	recorder->dumping = 0;
+	pthread_mutex_unlock(&recorder->lock);
+
+	close(recorder->fd);
+	recorder->fd = -1;
+
+	return NULL;
+}
+
+static void recorder_join(struct recorder *recorder)
+{
+	if (!recorder->thread_started)
+		return;
+
+	pthread_join(recorder->thread, NULL);
+	recorder->thread_started = 0;
+}
+
+static void recorder_free(struct recorder *recorder)
+{
+	if (!recorder)
+		return;
+
+	pthread_mutex_lock(&recorder->lock);
+	recorder->quit = 1;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->lock);
+	recorder_join(recorder);
+
+	if (recorder->arena)
+		munmap(recorder->arena, recorder->size);
+	pthread_mutex_destroy(&recorder->lock);
+	pthread_cond_destroy(&recorder->cond);
+	free(recorder);
+}
+
+static struct recorder *recorder_create(size_t size, int lock)
+{
+	pthread_condattr_t attr;
+	struct recorder *recorder = calloc(1, sizeof(*recorder));
+
+	if (!recorder) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	pthread_mutex_init(&recorder->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&recorder->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	recorder->fd = -1;
+
+	/* Faulted in now, so recording never waits for the allocator */
+	recorder->size = (size + RECORDER_ALIGN - 1) / RECORDER_ALIGN *
+		RECORDER_ALIGN;
+	recorder->arena = mmap(NULL, recorder->size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+			       -1, 0);
+	if (recorder->arena == MAP_FAILED) {
+		recorder->arena = NULL;
+		goto error;
+	}
+
+	if (lock && mlock(recorder->arena, recorder->size))
+		goto error;
+
+	return recorder;
+
+error:
+	PyErr_SetFromErrno(PyExc_IOError);
+	recorder_free(recorder);
+	return NULL;
+}
+
+/* Start dumping the window [now - before, now + after] to 'fd' */
+static int recorder_start_dump(struct recorder *recorder, int fd,
+			       uint32_t type, const struct v4l2_pix_format *pix,
+			       double before, double after)
+{
+	double now = monotonic_now();
+
+	pthread_mutex_lock(&recorder->lock);
+	if (recorder->dumping) {
+		pthread_mutex_unlock(&recorder->lock);
+		PyErr_SetString(PyExc_ValueError, "A dump is already running");
+		return -1;
+	}
+	pthread_mutex_unlock(&recorder->lock);
+
+	/* The previous dump is over */
+	recorder_join(recorder);
+
+	recorder->fd = fd;
+	recorder->type = type;
+	recorder->pix = *pix;
+	recorder->start = now - before;
+	recorder->end = now + after;
+	recorder->dumped = 0;
+	recorder->error = 0;
+	recorder->dumping = 1;
+
+	errno = pthread_create(&recorder->thread, NULL, recorder_dump,
+			       recorder);
+	if (errno) {
+		recorder->dumping = 0;
+		recorder->fd = -1;
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+
+	recorder->thread_started = 1;
+	return 0;
+}
+
+/*
+ * Replay
+ *
+ * A replay device maps a capture file and emulates the driver ioctls, so
+ * the whole read path runs unchanged. A dequeued buffer points at its frame
+ * in the mapping. Its file descriptor is a timer firing when the next frame
+ * is due, at the recorded pace or at once, which is what poll and wait see.
+ */
+struct replay {
+	char *path;
+	int realtime;
+	int loop;
+	/* Capture file mapping and the offsets of its records */
+	unsigned char *map;
+	size_t size;
+	const struct capture_header *header;
+	uint64_t *records;
+	unsigned long count;
+	uint32_t max_length;
+	int streaming;
+	/* Next record, and monotonic time the first record is due at */
+	unsigned long next;
+	double origin;
+	/* Indexes of the queued buffers, oldest first */
+	unsigned int *queue;
+	unsigned int buffers;
+	unsigned int queued;
+	unsigned int head;
+};
+
+static const struct capture_record *replay_record(struct replay *replay,
+						  unsigned long index)
+{
+	return (const struct capture_record *)(replay->map +
+					       replay->records[index]);
+}
+
+/* Monotonic time the next record is due at, 0 for at once */
+static double replay_due(struct replay *replay)
+{
+	if (!replay->realtime || replay->next >= replay->count)
+		return 0;
+
+	return replay->origin + replay_record(replay, replay->next)->received -
+		replay_record(replay, 0)->received;
+}
+
+/* Back to the first record, one mean frame period after the last one */
+static void replay_rewind(struct replay *replay)
+{
+	double span = replay_record(replay, replay->count - 1)->received -
+		replay_record(replay, 0)->received;
+
+	replay->origin += span;
+	if (replay->count > 1)
+		replay->origin += span / (replay->count - 1);
+	replay->next = 0;
+}
+
+static void replay_arm(video_device *videodev)
+{
+	double due = replay_due(videodev->replay);
+	struct itimerspec spec;
+
+	CLEAR(spec);
+
+	/* A due time in the past fires at once, so does the end of file to
+	 * report it */
+	if (videodev->replay->streaming) {
+		spec.it_value.tv_sec = due;
+		spec.it_value.tv_nsec = (due - spec.it_value.tv_sec) *
+			1000000000.0;
+		if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+			spec.it_value.tv_nsec = 1;
+	}
+
+	timerfd_settime(videodev->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void replay_pix(struct replay *replay, struct v4l2_pix_format *pix)
+{
+	const struct capture_header *header = replay->header;
+
+	memset(pix, 0, sizeof(*pix));
+	pix->width = header->width;
+	pix->height = header->height;
+	pix->pixelformat = header->fourcc;
+	pix->field = header->field;
+	pix->bytesperline = header->bytesperline;
+	pix->sizeimage = header->sizeimage;
+	pix->colorspace = header->colorspace;
+}
+
+static int replay_reqbufs(struct replay *replay,
+			  struct v4l2_requestbuffers *reqbuf)
+{
+	unsigned int count = reqbuf->count;
+	unsigned int *queue = NULL;
+
+	if (reqbuf->memory != V4L2_MEMORY_MMAP) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	if (replay->streaming) {
+		errno = EBUSY;
+		return 1;
+	}
+
+	if (count > VIDEO_MAX_FRAME)
+		count = VIDEO_MAX_FRAME;
+
+	if (count) {
+		queue = realloc(replay->queue, count * sizeof(*queue));
+		if (!queue)
+			return 1;
+	} else {
+		free(replay->queue);
+	}
+
+	replay->queue = queue;
+	replay->buffers = count;
+	replay->queued = 0;
+	replay->head = 0;
+	reqbuf->count = count;
+	return 0;
+}
+
+static int replay_qbuf(struct replay *replay, struct v4l2_buffer *buffer)
+{
+	unsigned int i;
+
+	if (buffer->index >= replay->buffers) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	for (i = 0; i < replay->queued; i++) {
+		if (replay->queue[(replay->head + i) % replay->buffers] ==
+		    buffer->index) {
+			errno = EINVAL;
+			return 1;
+		}
+	}
+
+	replay->queue[(replay->head + replay->queued++) % replay->buffers] =
+		buffer->index;
+	return 0;
+}
+
+static int replay_dqbuf(video_device *videodev, struct v4l2_buffer *buffer)
+{
+	double due = 0;
+	unsigned int index = 0;
+	struct replay *replay = videodev->replay;
+	const struct capture_record *record = NULL;
+
+	if (!replay->streaming || !replay->queued || !videodev->buffers) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	if (replay->next >= replay->count) {
+		if (!replay->loop || !replay->count) {
+			errno = ENODATA;
+			return 1;
+		}
+		replay_rewind(replay);
+	}
+
+	due = replay_due(replay);
+	if (due && monotonic_now() < due) {
+		errno = EAGAIN;
+		return 1;
+	}
+
+	record = replay_record(replay, replay->next++);
+	index = replay->queue[replay->head];
+	replay->head = (replay->head + 1) % replay->buffers;
+	replay->queued--;
+
+	videodev->buffers[index].start = (unsigned char *)(record + 1);
+	videodev->buffers[index].length = record->length;
+
+	buffer->index = index;
+	buffer->bytesused = record->length;
+	buffer->length = replay->max_length;
+	buffer->field = record->field;
+	buffer->sequence = record->sequence;
+	buffer->timestamp.tv_sec = record->tv_sec;
+	buffer->timestamp.tv_usec = record->tv_usec;
+	/* The recorded timestamps are not from this clock */
+	buffer->flags = (record->flags & ~V4L2_BUF_FLAG_TIMESTAMP_MASK) |
+		V4L2_BUF_FLAG_TIMESTAMP_COPY;
+
+	replay_arm(videodev);
+	return 0;
+}
+
+static int replay_ioctl(video_device *videodev, int request, void *arg)
+{
+	struct replay *replay = videodev->replay;
+	const struct capture_header *header = replay->header;
+
+	if (!replay->map) {
+		errno = EBADF;
+		return 1;
+	}
+
+	switch (request) {
+	case VIDIOC_QUERYCAP: {
+		struct v4l2_capability *caps = arg;
+
+		memset(caps, 0, sizeof(*caps));
+		snprintf((char *)caps->driver, sizeof(caps->driver),
+			 "pyv4l2-replay");
+		snprintf((char *)caps->card, sizeof(caps->card), "%s",
+			 replay->path);
+		snprintf((char *)caps->bus_info, sizeof(caps->bus_info),
+			 "file");
+		caps->device_caps = V4L2_CAP_VIDEO_CAPTURE |
+			V4L2_CAP_STREAMING;
+		caps->capabilities = caps->device_caps | V4L2_CAP_DEVICE_CAPS;
+		return 0;
+	}
+	case VIDIOC_ENUM_FMT: {
+		struct v4l2_fmtdesc *desc = arg;
+
+		if (desc->index || desc->type != header->type)
+			break;
+
+		desc->flags = 0;
+		desc->pixelformat = header->fourcc;
+		snprintf((char *)desc->description,
+			 sizeof(desc->description), "Capture file");
+		return 0;
+	}
+	case VIDIOC_ENUM_FRAMESIZES: {
+		struct v4l2_frmsizeenum *frmsize = arg;
+
+		if (frmsize->index || frmsize->pixel_format != header->fourcc)
+			break;
+
+		frmsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+		frmsize->discrete.width = header->width;
+		frmsize->discrete.height = header->height;
+		return 0;
+	}
+	/* The recorded format is the only one */
+	case VIDIOC_G_FMT:
+	case VIDIOC_S_FMT:
+	case VIDIOC_TRY_FMT: {
+		struct v4l2_format *format = arg;
+
+		if (format->type != header->type)
+			break;
+
+		replay_pix(replay, &format->fmt.pix);
+		return 0;
+	}
+	case VIDIOC_REQBUFS:
+		return replay_reqbufs(replay, arg);
+	case VIDIOC_QUERYBUF: {
+		struct v4l2_buffer *buffer = arg;
+
+		if (buffer->index >= replay->buffers)
+			break;
+
+		buffer->length = replay->max_length;
+		buffer->bytesused = 0;
+		buffer->flags = 0;
+		buffer->m.offset = 0;
+		return 0;
+	}
+	case VIDIOC_QBUF:
+		return replay_qbuf(replay, arg);
+	case VIDIOC_DQBUF:
+		return replay_dqbuf(videodev, arg);
+	case VIDIOC_STREAMON:
+		if (!replay->buffers)
+			break;
+
+		/* Resume from the next record */
+		replay->streaming = 1;
+		replay->origin = monotonic_now();
+		if (replay->next < replay->count)
+			replay->origin -=
+				replay_record(replay, replay->next)->received -
+				replay_record(replay, 0)->received;
+		replay_arm(videodev);
+		return 0;
+	case VIDIOC_STREAMOFF:
+		replay->streaming = 0;
+		replay->queued = 0;
+		replay->head = 0;
+		replay_arm(videodev);
+		return 0;
+	default:
+		errno = ENOTTY;
+		return 1;
+	}
+
+	errno = EINVAL;
+	return 1;
+}
+
+/* Index the complete records, a truncated one ends the file */
+static int replay_scan(struct replay *replay)
+{
+	uint64_t offset = 0;
+	unsigned long allocated = 0;
+	uint64_t *records = NULL;
+	const struct capture_record *record = NULL;
+	uint32_t page = replay->header->page_size;
+
+	offset = capture_next(sizeof(struct capture_header), page);
+
+	while (offset + sizeof(*record) <= replay->size) {
+		record = (const struct capture_record *)(replay->map + offset);
+		if (record->magic != CAPTURE_RECORD_MAGIC ||
+		    record->length > replay->size - offset - sizeof(*record))
+			break;
+
+		if (replay->count == allocated) {
+			allocated = allocated ? allocated * 2 : 256;
+			records = realloc(replay->records,
+					  allocated * sizeof(*records));
+			if (!records)
+				return -1;
+			replay->records = records;
+		}
+
+		replay->records[replay->count++] = offset;
+		if (record->length > replay->max_length)
+			replay->max_length = record->length;
+
+		offset = capture_next(offset + sizeof(*record) +
+				      record->length, page);
+	}
+
+	return 0;
+}
+
+static void replay_close(video_device *videodev)
+{
+	struct replay *replay = videodev->replay;
+
+	if (replay->map)
+		munmap(replay->map, replay->size);
+	free(replay->records);
+	free(replay->queue);
+
+	replay->map = NULL;
+	replay->header = NULL;
+	replay->records = NULL;
+	replay->count = 0;
+	replay->max_length = 0;
+	replay->streaming = 0;
+	replay->next = 0;
+	replay->queue = NULL;
+	replay->buffers = 0;
+	replay->queued = 0;
+	replay->head = 0;
+}
+
+static int replay_open(video_device *videodev)
+{
+	int fd = -1;
+	struct stat st;
+	struct replay *replay = videodev->replay;
+	const struct capture_header *header = NULL;
+
+	if (videodev->fd >= 0) {
+		close(videodev->fd);
+		videodev->fd = -1;
+	}
+	replay_close(videodev);
+
+	fd = open(replay->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st))
+		goto error;
+
+	if (st.st_size < (off_t)sizeof(*header)) {
+		close(fd);
+		goto invalid;
+	}
+
+	replay->size = st.st_size;
+	replay->map = mmap(NULL, replay->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (replay->map == MAP_FAILED) {
+		replay->map = NULL;
+		goto error;
+	}
+	close(fd);
+	fd = -1;
+
+	madvise(replay->map, replay->size, MADV_SEQUENTIAL);
+
+	header = (const struct capture_header *)replay->map;
+	if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) ||
+	    header->version != CAPTURE_VERSION ||
+	    header->page_size < 2 * sizeof(struct capture_record) ||
+	    header->page_size & (header->page_size - 1))
+		goto invalid;
+
+	replay->header = header;
+	if (replay_scan(replay)) {
+		PyErr_NoMemory();
+		goto fail;
+	}
+
+	videodev->fd = timerfd_create(CLOCK_MONOTONIC,
+				      TFD_NONBLOCK | TFD_CLOEXEC);
+	if (videodev->fd < 0)
+		goto error;
+
+	videodev->type = header->type;
+	CLEAR(videodev->pix);
+	return 0;
+
+invalid:
+	PyErr_Format(PyExc_ValueError, "'%s' is not a capture file",
+		     replay->path);
+	goto fail;
+error:
+	PyErr_SetFromErrnoWithFilename(PyExc_IOError, replay->path);
+	if (fd >= 0)
+		close(fd);
+fail:
+	replay_close(videodev);
+	return -1;
+}
+
+static void replay_free(struct replay *replay)
+{
+	if (!replay)
+		return;
+
+	if (replay->map)
+		munmap(replay->map, replay->size);
+	free(replay->records);
+	free(replay->queue);
+	free(replay->path);
+	free(replay);
+}
+
+/*
+ * Snapshots
+ *
+ * A snapshot keeps its dequeued buffer while a worker thread writes it to a
+ * file: JPEG frames as they are, other formats converted row by row into
+ * the encoder, so the caller neither waits for the encoding nor copies the
+ * frame. The worker never touches the device: the buffers it is done with
+ * are queued back by the next call reading from it.
+ */
+#define SNAPSHOT_JPEG		0
+#define SNAPSHOT_PNG		1
+/* At least JMSG_LENGTH_MAX */
+#define SNAPSHOT_MESSAGE	200
+
+/* Outcome of a snapshot, shared by the job and its future */
+struct snapshot_result {
+	int refs;
+	int done;
+	int error;
+	char message[SNAPSHOT_MESSAGE];
+	/* Readable once done */
+	int event;
+};
+
+struct snapshot_job {
+	struct snapshot_job *next;
+	struct frame frame;
+	/* Rows of the worker when demosaicing */
+	struct demosaic_lane lane;
+	unsigned int index;
+	int format;
+	int quality;
+	int fd;
+	struct snapshot_result *result;
+};
+
+struct snapshots {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	struct snapshot_job *head;
+	struct snapshot_job *tail;
+	int busy;
+	int quit;
+	/* Buffers written, to queue back */
+	unsigned int returned[VIDEO_MAX_FRAME];
+	unsigned int returned_count;
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct snapshot_result *result;
+	PyObject *path;
+} snapshot_future;
+
+/* Huffman tables of the JPEG standard (K.3), which MJPG frames leave out */
+static const unsigned char jpeg_default_dht[] = {
+	0xff, 0xc4, 0x01, 0xa2,
+	/* Luminance DC */
+	0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04,
+	0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+	/* Luminance AC */
+	0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05,
+	0x04, 0x04, 0x00, 0x00, 0x01, 0x7d,
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41,
+	0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91,
+	0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24,
+	0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a,
+	0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38,
+	0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53,
+	0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66,
+	0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93,
+	0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7,
+	0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+	0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2,
+	0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+	/* Chrominance DC */
+	0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04,
+	0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+	/* Chrominance AC */
+	0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05,
+	0x04, 0x04, 0x00, 0x01, 0x02, 0x77,
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12,
+	0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14,
+	0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15,
+	0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17,
+	0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37,
+	0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a,
+	0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65,
+	0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+	0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a,
+	0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+	0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5,
+	0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+	0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9,
+	0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2,
+	0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+static struct snapshot_result *snapshot_result_new(void)
+{
+	struct snapshot_result *result = calloc(1, sizeof(*result));
+
+	if (!result)
+		return NULL;
+
+	result->event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (result->event < 0) {
+		free(result);
+		return NULL;
+	}
+
+	/* The job and the future */
+	result->refs = 2;
+	return result;
+}
+
+static void snapshot_result_unref(struct snapshot_result *result)
+{
+	if (!result || __atomic_sub_fetch(&result->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	close(result->event);
+	free(result);
+}
+
+static void snapshot_result_finish(struct snapshot_result *result)
+{
+	uint64_t one = 1;
+	ssize_t ret = 0;
+
+	__atomic_store_n(&result->done, 1, __ATOMIC_RELEASE);
+	ret = write(result->event, &one, sizeof(one));
+	(void)ret;
+}
+
+/* Output format of the rows the encoders get */
+static __u32 snapshot_fourcc(const struct frame *frame)
+{
+	if (frame->fourcc == V4L2_PIX_FMT_YUYV)
+		return V4L2_PIX_FMT_RGB24;
+
+	return frame_output_fourcc(frame);
+}
+
+/* 16 bits grey, the significant bits being the low ones */
+static int snapshot_is_grey16(__u32 fourcc)
+{
+	return fourcc == V4L2_PIX_FMT_Y10 || fourcc == V4L2_PIX_FMT_Y12 ||
+		fourcc == V4L2_PIX_FMT_Y16;
+}
+
+#if defined(USE_LIBJPEG) || defined(USE_LIBPNG)
+static const unsigned char *snapshot_row(struct snapshot_job *job,
+					 unsigned int y,
+					 unsigned char *scratch)
+{
+	const struct frame *frame = &job->frame;
+
+	/* libv4l delivers YUYV as is */
+	if (frame->fourcc == V4L2_PIX_FMT_YUYV) {
+		convert_yuyv_rgb_row(frame_row(frame, y), scratch,
+				     frame->rect.width);
+		return scratch;
+	}
+
+	return frame_fetch_row(frame, y, scratch);
+}
+#endif
+
+/* The frame as is, with the default Huffman tables if it has none */
+static int snapshot_write_jpeg_frame(struct snapshot_job *job)
+{
+	int count = 1;
+	int has_dht = 0;
+	size_t pos = 2;
+	struct iovec iov[3];
+	const unsigned char *data = job->frame.data;
+	size_t size = job->frame.size;
+
+	if (size < 4 || data[0] != 0xff || data[1] != 0xd8) {
+		snprintf(job->result->message, SNAPSHOT_MESSAGE,
+			 "Not a JPEG frame");
+		return -1;
+	}
+
+	/* Tables are defined before the start of scan */
+	while (pos + 4 <= size && data[pos] == 0xff && data[pos + 1] != 0xda) {
+		if (data[pos + 1] == 0xff) {
+			pos++;
+			continue;
+		}
+
+		if (data[pos + 1] == 0xc4)
+			has_dht = 1;
+		pos += 2 + (data[pos + 2] << 8 | data[pos + 3]);
+	}
+
+	iov[0].iov_base = (void *)data;
+	iov[0].iov_len = size;
+
+	if (!has_dht && pos + 2 <= size && data[pos] == 0xff &&
+	    data[pos + 1] == 0xda) {
+		iov[0].iov_len = pos;
+		iov[1].iov_base = (void *)jpeg_default_dht;
+		iov[1].iov_len = sizeof(jpeg_default_dht);
+		iov[2].iov_base = (void *)(data + pos);
+		iov[2].iov_len = size - pos;
+		count = 3;
+	}
+
+	if (write_vector(job->fd, iov, count)) {
+		job->result->error = errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef USE_LIBJPEG
+static void snapshot_swap_rgb(const unsigned char *src, unsigned char *dst,
+			      unsigned int width)
+{
+	unsigned int x;
+
+	for (x = 0; x < width; x++, src += 3, dst += 3) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+	}
+}
+
+struct snapshot_jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+	char *message;
+};
+
+static void snapshot_jpeg_exit(j_common_ptr cinfo)
+{
+	struct snapshot_jpeg_error *error =
+		(struct snapshot_jpeg_error *)cinfo->err;
+
+	(*cinfo->err->format_message)(cinfo, error->message);
+	longjmp(error->jump, 1);
+}
+
+static int snapshot_encode_jpeg(struct snapshot_job *job, FILE *file,
+				unsigned char *scratch)
+{
+	unsigned int y;
+	JSAMPROW row = NULL;
+	struct jpeg_compress_struct cinfo;
+	struct snapshot_jpeg_error error;
+	unsigned int width = job->frame.rect.width;
+	__u32 fourcc = snapshot_fourcc(&job->frame);
+
+	cinfo.err = jpeg_std_error(&error.mgr);
+	error.mgr.error_exit = snapshot_jpeg_exit;
+	error.message = job->result->message;
+
+	if (setjmp(error.jump)) {
+		jpeg_destroy_compress(&cinfo);
+		return -1;
+	}
+
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, file);
+
+	cinfo.image_width = width;
+	cinfo.image_height = job->frame.rect.height;
+	cinfo.input_components = fourcc == V4L2_PIX_FMT_GREY ? 1 : 3;
+	cinfo.in_color_space = fourcc == V4L2_PIX_FMT_GREY ?
+		JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, job->quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	for (y = 0; y < cinfo.image_height; y++) {
+		row = (JSAMPROW)snapshot_row(job, y, scratch);
+		if (fourcc == V4L2_PIX_FMT_BGR24) {
+			snapshot_swap_rgb(row, scratch + width * 4, width);
+			row = scratch + width * 4;
+		}
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	return 0;
+}
+#endif /* USE_LIBJPEG */
+
+#ifdef USE_LIBPNG
+static void snapshot_png_error(png_structp png, png_const_charp message)
+{
+	struct snapshot_job *job = png_get_error_ptr(png);
+
+	snprintf(job->result->message, SNAPSHOT_MESSAGE, "%s", message);
+	png_longjmp(png, 1);
+}
+
+static int snapshot_encode_png(struct snapshot_job *job, FILE *file,
+			       unsigned char *scratch)
+{
+	unsigned int y;
+	png_structp png = NULL;
+	png_infop info = NULL;
+	png_color_8 bits;
+	__u32 fourcc = snapshot_fourcc(&job->frame);
+	int grey16 = snapshot_is_grey16(fourcc);
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, job,
+				      snapshot_png_error, NULL);
+	if (png)
+		info = png_create_info_struct(png);
+	if (!info) {
+		png_destroy_write_struct(&png, NULL);
+		job->result->error = ENOMEM;
+		return -1;
+	}
+
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		return -1;
+	}
+
+	png_init_io(png, file);
+	png_set_IHDR(png, info, job->frame.rect.width, job->frame.rect.height,
+		     grey16 ? 16 : 8,
+		     fourcc == V4L2_PIX_FMT_GREY || grey16 ?
+		     PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB,
+		     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		     PNG_FILTER_TYPE_DEFAULT);
+
+	/* Samples are scaled to the full 16 bits range */
+	if (grey16) {
+		memset(&bits, 0, sizeof(bits));
+		bits.gray = fourcc_depth(fourcc);
+		png_set_sBIT(png, info, &bits);
+	}
+
+	/* Compress for speed, the snapshot has to keep up with the capture */
+	png_set_compression_level(png, 1);
+	png_write_info(png, info);
+
+	if (fourcc == V4L2_PIX_FMT_BGR24)
+		png_set_bgr(png);
+	if (grey16 && bits.gray < 16)
+		png_set_shift(png, &bits);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (grey16)
+		png_set_swap(png);
+#endif
+
+	for (y = 0; y < job->frame.rect.height; y++)
+		png_write_row(png, snapshot_row(job, y, scratch));
+
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+	return 0;
+}
+#endif /* USE_LIBPNG */
+
+static void snapshot_write(struct snapshot_job *job)
+{
+	int ret = -1;
+	FILE *file = NULL;
+	unsigned char *scratch = NULL;
+
+	if (frame_is_compressed(&job->frame)) {
+		ret = snapshot_write_jpeg_frame(job);
+		if (close(job->fd) && !ret)
+			job->result->error = errno;
+		return;
+	}
+
+	/* A converted row, and the same with red and blue swapped */
+	scratch = malloc((size_t)job->frame.rect.width * 8);
+	if (scratch)
+		file = fdopen(job->fd, "wb");
+	if (!file) {
+		job->result->error = scratch ? errno : ENOMEM;
+		close(job->fd);
+		free(scratch);
+		return;
+	}
+
+#ifdef USE_LIBJPEG
+	if (job->format == SNAPSHOT_JPEG)
+		ret = snapshot_encode_jpeg(job, file, scratch);
+#endif
+#ifdef USE_LIBPNG
+	if (job->format == SNAPSHOT_PNG)
+		ret = snapshot_encode_png(job, file, scratch);
+#endif
+
+	if (fclose(file) && !ret)
+		job->result->error = errno;
+	free(scratch);
+}
+
+static void *snapshot_worker(void *arg)
+{
+	struct snapshots *snapshots = arg;
+	struct snapshot_job *job = NULL;
+
+	pthread_mutex_lock(&snapshots->lock);
+
+	/* Pending jobs are still written when quitting */
+	for (;;) {
+		while (!snapshots->head && !snapshots->quit)
+			pthread_cond_wait(&snapshots->wake, &snapshots->lock);
+
+		job = snapshots->head;
+		if (!job)
+			break;
+
+		snapshots->head = job->next;
+		if (!snapshots->head)
+			snapshots->tail = NULL;
+		snapshots->busy = 1;
+		pthread_mutex_unlock(&snapshots->lock);
+
+		snapshot_write(job);
+		demosaic_lane_free(&job->lane);
+
+		pthread_mutex_lock(&snapshots->lock);
+		if (snapshots->returned_count < VIDEO_MAX_FRAME)
+			snapshots->returned[snapshots->returned_count++] =
+				job->index;
+		snapshots->busy = 0;
+		snapshot_result_finish(job->result);
+		snapshot_result_unref(job->result);
+		free(job);
+		pthread_cond_broadcast(&snapshots->idle);
+	}
+
+	pthread_mutex_unlock(&snapshots->lock);
+	return NULL;
+}
+
+static struct snapshots *snapshots_create(void)
+{
+	struct snapshots *snapshots = calloc(1, sizeof(*snapshots));
+
+	if (!snapshots) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	pthread_mutex_init(&snapshots->lock, NULL);
+	pthread_cond_init(&snapshots->wake, NULL);
+	pthread_cond_init(&snapshots->idle, NULL);
+
+	errno = pthread_create(&snapshots->thread, NULL, snapshot_worker,
+			       snapshots);
+	if (errno) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		pthread_mutex_destroy(&snapshots->lock);
+		pthread_cond_destroy(&snapshots->wake);
+		pthread_cond_destroy(&snapshots->idle);
+		free(snapshots);
+		return NULL;
+	}
+
+	return snapshots;
+}
+
+static void snapshots_submit(struct snapshots *snapshots,
+			     struct snapshot_job *job)
+{
+	pthread_mutex_lock(&snapshots->lock);
+	if (snapshots->tail)
+		snapshots->tail->next = job;
+	else
+		snapshots->head = job;
+	snapshots->tail = job;
+	pthread_cond_signal(&snapshots->wake);
+	pthread_mutex_unlock(&snapshots->lock);
+}
+
+/* Wait for the pending snapshots */
+static void snapshots_drain(struct snapshots *snapshots)
+{
+	pthread_mutex_lock(&snapshots->lock);
+	while (snapshots->head || snapshots->busy)
+		pthread_cond_wait(&snapshots->idle, &snapshots->lock);
+	pthread_mutex_unlock(&snapshots->lock);
+}
+
+/* Write the pending snapshots and stop the worker */
+static void snapshots_free(struct snapshots *snapshots)
+{
+	if (!snapshots)
+		return;
+
+	pthread_mutex_lock(&snapshots->lock);
+	snapshots->quit = 1;
+	pthread_cond_signal(&snapshots->wake);
+	pthread_mutex_unlock(&snapshots->lock);
+	pthread_join(snapshots->thread, NULL);
+
+	pthread_mutex_destroy(&snapshots->lock);
+	pthread_cond_destroy(&snapshots->wake);
+	pthread_cond_destroy(&snapshots->idle);
+	free(snapshots);
+}
+
+/* Queue back the buffers of the written snapshots */
+static void video_device_requeue_snapshots(video_device *videodev)
+{
+	unsigned int i;
+	unsigned int count = 0;
+	unsigned int returned[VIDEO_MAX_FRAME];
+	struct snapshots *snapshots = videodev->snapshots;
+	struct v4l2_buffer buffer;
+
+	if (!snapshots)
+		return;
+
+	pthread_mutex_lock(&snapshots->lock);
+	count = snapshots->returned_count;
+	memcpy(returned, snapshots->returned, count * sizeof(*returned));
+	snapshots->returned_count = 0;
+	pthread_mutex_unlock(&snapshots->lock);
+
+	/* One failing stays dequeued, as after a failed read */
+	for (i = 0; i < count; i++) {
+		CLEAR(buffer);
+		buffer.index = returned[i];
+		buffer.type = videodev->type;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		video_device_ioctl(videodev, VIDIOC_QBUF, &buffer);
+	}
+}
+
+/* Size of the delivered image, 0 for compressed frames */
+static void video_device_output_dims(video_device *videodev,
+				     const struct frame *frame,
+				     unsigned int *width,
+				     unsigned int *height)
+{
+	*width = frame->rect.width;
+	*height = frame->rect.height;
+
+	if (videodev->scaler)
+		scaler_output_size(videodev->scaler, width, height);
+	else if (frame_is_compressed(frame))
+		*width = *height = 0;
+}
+
+static size_t video_device_output_size(video_device *videodev,
+				       const struct frame *frame)
+{
+	unsigned int width = 0;
+	unsigned int height = 0;
+
+	if (!videodev->scaler)
+		return frame_output_size(frame);
+
+	scaler_output_size(videodev->scaler, &width, &height);
+	return (size_t)width * height * scaler_channels(frame);
+}
+
+/* Largest frame the current settings can deliver */
+static int video_device_max_output_size(video_device *videodev,
+					size_t *size)
+{
+	struct frame frame;
+	struct v4l2_pix_format *pix = &videodev->pix;
+
+	if (!pix->width && video_device_refresh_format(videodev))
+		return -1;
+
+	CLEAR(frame);
+	frame.fourcc = pix->pixelformat;
+	frame.size = pix->sizeimage;
+	frame.height = pix->height;
+	frame.rect.width = pix->width;
+	frame.rect.height = pix->height;
+	frame.bayer = video_device_bayer(videodev, frame.fourcc);
+	frame.to_8bit = videodev->depth == 8;
+	if (videodev->crop.width)
+		frame.rect = videodev->crop;
+
+	*size = video_device_output_size(videodev, &frame);
+	return 0;
+}
+
+static int video_device_process(video_device *videodev,
+				struct frame *frame,
+				unsigned char *dst)
+{
+	__u32 fourcc = frame_output_fourcc(frame);
+	unsigned int channels = scaler_channels(frame);
+
+	if (videodev->stats) {
+		if (frame_is_planar(frame))
+			channels = 1;
+
+		if (frame_stats_begin(videodev->stats, frame->rect.width,
+				      channels,
+				      fourcc == V4L2_PIX_FMT_BGR24 ||
+				      fourcc == V4L2_PIX_FMT_BGR32))
+			return -1;
+
+		frame->stats = videodev->stats;
+	}
+
+	if (frame->bayer && demosaic_begin(videodev->demosaic, frame))
+		return -1;
+
+	if (videodev->scaler)
+		return scaler_run(videodev->scaler, frame, dst);
+
+	frame_convert(frame, dst);
+	return 0;
+}
+
+/*
+ * Dequeue the next frame to deliver, 1 when one is found and 0 when only
+ * skipped frames were available.
+ */
+static int video_device_next_frame(video_device *videodev, int queue,
+				   struct v4l2_buffer *buffer,
+				   struct frame *frame)
+{
+	int dropped = 0;
+
+	if (!videodev->buffers) {
+		PyErr_SetString(PyExc_ValueError,
+				"Buffers have not been created");
+		return -1;
+	}
+
+	if (!videodev->pix.width && video_device_refresh_format(videodev))
+		return -1;
+
+	if (thread_setup_apply(&videodev->thread))
+		return -1;
+
+	video_device_requeue_snapshots(videodev);
+
+	/* Skipped frames go back to the driver without being converted */
+	for (;;) {
+		CLEAR(*buffer);
+		buffer->type = videodev->type;
+		buffer->memory = V4L2_MEMORY_MMAP;
+
+		if (video_device_ioctl(videodev, VIDIOC_DQBUF, buffer)) {
+			if (errno == EAGAIN && dropped)
+				return 0;
+			PyErr_SetFromErrno(PyExc_IOError);
+			return -1;
+		}
+
+		timing_stats_add(&videodev->timing, buffer);
+
+		if (videodev->recorder)
+			recorder_add(videodev->recorder, &videodev->pix, buffer,
+				     videodev->buffers[buffer->index].start);
+
+		if (videodev->capture)
+			capture_add(videodev->capture, buffer,
+				    videodev->buffers[buffer->index].start,
+				    buffer->bytesused ? buffer->bytesused :
+				    videodev->pix.sizeimage);
+
+		if (video_device_accept(videodev, buffer)) {
+			if (video_device_frame(videodev, buffer, frame))
+				goto requeue;
+
+			if (!videodev->gate ||
+			    motion_gate_accept(videodev->gate, frame,
+					       timeval2sec(&buffer->timestamp)))
+				break;
+		}
+
+		if (video_device_ioctl(videodev, VIDIOC_QBUF, buffer)) {
+			PyErr_SetFromErrno(PyExc_IOError);
+			return -1;
+		}
+		dropped = 1;
+	}
+
+	if (videodev->scaler && !scaler_channels(frame)) {
+		PyErr_SetString(PyExc_ValueError, "Scaling needs a packed RGB "
+				"or grey output format");
+		goto requeue;
+	}
+
+	return 1;
+
+requeue:
+	if (queue)
+		video_device_ioctl(videodev, VIDIOC_QBUF, buffer);
+	return -1;
+}
+
+/*
+ * Dequeue the next frame to deliver and convert it, either to a new string
+ * or to the caller's buffer 'into' (the result is then the length written).
+ * When publishing, the frame is converted in a slot of the shared ring
+ * first, and with 'publish_only' the result is just its sequence number.
+ */
+static PyObject *video_device_read_internal(video_device *videodev,
+					    int queue, Py_buffer *into,
+					    int publish_only)
+{
+	int ret = 0;
+	size_t size = 0;
+	unsigned int width = 0;
+	unsigned int height = 0;
+	unsigned char *dst = NULL;
+	PyObject *result = NULL;
+	struct shm_ring_slot *slot = NULL;
+	struct v4l2_buffer buffer;
+	struct frame frame;
+
+	ret = video_device_next_frame(videodev, queue, &buffer, &frame);
+	if (ret <= 0) {
+		if (ret < 0)
+			return NULL;
+		Py_RETURN_NONE;
+	}
+
+	size = video_device_output_size(videodev, &frame);
+
+	if (videodev->ring)
+		slot = shm_ring_begin(videodev->ring, size);
+
+	if (publish_only && slot) {
+		result = PyLong_FromUnsignedLongLong(videodev->ring->seq + 1);
+	} else if (publish_only) {
+		/* Not published, every slot is still being read */
+		Py_INCREF(Py_None);
+		result = Py_None;
+	} else if (into) {
+		if (into->len < size) {
+			PyErr_Format(PyExc_ValueError, "Buffer of %zd bytes is "
+				     "too small for a %zu bytes frame",
+				     into->len, size);
+			goto requeue;
+		}
+
+		result = PyLong_FromSize_t(size);
+		dst = into->buf;
+	} else {
+		result = PYSTRING_FROM_STR_SZ(NULL, size);
+		if (result)
+			dst = (unsigned char *)PYSTRING_AS_STRING(result);
+	}
+
+	if (!result)
+		goto requeue;
+
+	if (slot) {
+		unsigned char *data = (unsigned char *)slot + SHM_SLOT_HEADER;
+
+		if (video_device_process(videodev, &frame, data)) {
+			Py_DECREF(result);
+			goto requeue;
+		}
+
+		if (dst)
+			memcpy(dst, data, size);
+
+		video_device_output_dims(videodev, &frame, &width, &height);
+		shm_ring_commit(videodev->ring, slot, &frame, size,
+				timeval2sec(&buffer.timestamp), width, height);
+		slot = NULL;
+	} else if (dst && video_device_process(videodev, &frame, dst)) {
+		Py_DECREF(result);
+		goto requeue;
+	}
+
+	if (queue && video_device_ioctl(videodev, VIDIOC_QBUF, &buffer)) {
+		Py_DECREF(result);
+		return PyErr_SetFromErrno(PyExc_IOError);
+	}
+
+	return result;
+
+requeue:
+	if (slot)
+		shm_ring_abort(slot);
+	if (queue)
+		video_device_ioctl(videodev, VIDIOC_QBUF, &buffer);
+	return NULL;
+}
+
+static PyObject *video_device_read(video_device *videodev)
+{
+	return video_device_read_internal(videodev, 0, NULL, 0);
+}
+
+static PyObject *video_device_read_and_queue(video_device *videodev)
+{
+	return video_device_read_internal(videodev, 1, NULL, 0);
+}
+
+static PyObject *video_device_read_into(video_device *videodev,
+					PyObject *args)
+{
+	int queue = 1;
+	Py_buffer into;
+	PyObject *result = NULL;
+
+	if (!PyArg_ParseTuple(args, "w*|i", &into, &queue))
+		return NULL;
+
+	result = video_device_read_internal(videodev, queue, &into, 0);
+	PyBuffer_Release(&into);
+
+	return result;
+}
+
+static PyObject *video_device_set_scale(video_device *videodev,
+					PyObject *args, PyObject *keywds)
+{
+	int size_x = 0;
+	int size_y = 0;
+	int rotation = 0;
+	int filter = SCALE_BOX;
+	struct scaler *scaler = NULL;
+	static char *kwlist[] = {
+		"size_x",
+		"size_y",
+		"rotation",
+		"filter",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|iiii", kwlist,
+					 &size_x, &size_y, &rotation,
+					 &filter))
+		return NULL;
+
+	rotation = ((rotation % 360) + 360) % 360;
+
+	if (rotation % 90)
+		return PyErr_Format(PyExc_ValueError, "Rotation must be a "
+				    "multiple of 90 degrees");
+
+	if (filter != SCALE_BOX && filter != SCALE_BILINEAR)
+		return PyErr_Format(PyExc_ValueError, "Unknown filter %d",
+				    filter);
+
+	if (size_x < 0 || size_y < 0)
+		return PyErr_Format(PyExc_ValueError, "Invalid size");
+
+	scaler_free(videodev->scaler);
+	videodev->scaler = NULL;
+
+	if (!size_x || !size_y)
+		Py_RETURN_NONE;
+
+	if (0 == (scaler = calloc(1, sizeof(*scaler))))
+		return PyErr_NoMemory();
+
+	/* The requested size is the one of the rotated image */
+	scaler->width = size_x;
+	scaler->height = size_y;
+	if (rotation == 90 || rotation == 270) {
+		scaler->width = size_y;
+		scaler->height = size_x;
+	}
+	scaler->rotation = rotation;
+	scaler->filter = filter;
+	videodev->scaler = scaler;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_set_demosaic(video_device *videodev,
+					   PyObject *args, PyObject *keywds)
+{
+	int method = DEMOSAIC_BILINEAR;
+	int threads = 1;
+	struct demosaic *demosaic = NULL;
+	struct snapshots *snapshots = NULL;
+	static char *kwlist[] = {
+		"method",
+		"threads",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|ii", kwlist,
+					 &method, &threads))
+		return NULL;
+
+	if (method != DEMOSAIC_NONE && method != DEMOSAIC_BILINEAR &&
+	    method != DEMOSAIC_EDGE)
+		return PyErr_Format(PyExc_ValueError, "Unknown demosaic "
+				    "method %d", method);
+
+	if (threads < 1 || threads > DEMOSAIC_MAX_THREADS)
+		return PyErr_Format(PyExc_ValueError, "Invalid thread count "
+				    "%d", threads);
+
+	if (video_device_check_snapshots(videodev))
+		return NULL;
+
+	/* Pending snapshots demosaic with the current pool, none may be
+	 * taken until it is replaced */
+	snapshots = videodev->snapshots;
+	if (snapshots) {
+		videodev->snapshots_blocked++;
+		Py_BEGIN_ALLOW_THREADS
+		snapshots_drain(snapshots);
+		Py_END_ALLOW_THREADS
+	}
+
+	demosaic_free(videodev->demosaic);
+	videodev->demosaic = NULL;
+	if (snapshots)
+		videodev->snapshots_blocked--;
+
+	if (method == DEMOSAIC_NONE)
+		Py_RETURN_NONE;
+
+	if (0 == (demosaic = demosaic_new(method, threads)))
+		return PyErr_NoMemory();
+
+	videodev->demosaic = demosaic;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_set_depth(video_device *videodev,
+					PyObject *args)
+{
+	int depth = 16;
+
+	if (!PyArg_ParseTuple(args, "|i", &depth))
+		return NULL;
+
+	if (depth != 8 && depth != 16)
+		return PyErr_Format(PyExc_ValueError, "Depth must be 8 or 16, "
+				    "not %d", depth);
+
+	videodev->depth = depth;
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * Format negotiation
+ *
+ * Every format the driver offers at a size and rate meeting the request is
+ * priced by the conversion giving the wanted output from it: none, one of
+ * the native converters, or libv4l for the formats it emulates. Costs are
+ * CPU nanoseconds per pixel, built in or measured on this machine.
+ */
+#define CONVERT_COPY		0
+#define CONVERT_YUYV		1
+#define CONVERT_DEMOSAIC	2
+#define CONVERT_UNPACK		3
+#define CONVERT_REDUCE		4
+#define CONVERT_LIBV4L		5
+#define CONVERT_JPEG		6
+#define CONVERT_KINDS		7
+
+#define CALIBRATE_WIDTH		320
+#define CALIBRATE_HEIGHT	240
+
+static const char *const convert_names[CONVERT_KINDS] = {
+	"copy", "yuyv", "demosaic", "unpack", "reduce", "libv4l", "jpeg"
+};
+
+/* Measured on a 3 GHz x86-64 core, libv4l ones from its YUYV and JPEG
+ * conversions */
+static const double convert_costs[CONVERT_KINDS] = {
+	0.15, 2.0, 3.0, 0.8, 0.6, 3.0, 12.0
+};
+
+struct negotiation {
+	__u32 output;
+	unsigned int width;
+	unsigned int height;
+	double min_fps;
+	double costs[CONVERT_KINDS];
+	/* Cheapest candidate so far */
+	int found;
+	__u32 fourcc;
+	int conversion;
+	unsigned int best_width;
+	unsigned int best_height;
+	struct v4l2_fract interval;
+	double cost;
+};
+
+/* Native conversion from 'fourcc' to 'output', -1 if there is none */
+static int negotiate_conversion(__u32 fourcc, __u32 output)
+{
+	unsigned int red_x = 0;
+	unsigned int red_y = 0;
+
+	if (fourcc == output)
+		return CONVERT_COPY;
+
+	if (output == V4L2_PIX_FMT_RGB24 &&
+	    !fourcc_bayer(fourcc, &red_x, &red_y))
+		return CONVERT_DEMOSAIC;
+
+	if (fourcc_depth(fourcc) && output == fourcc_unpacked(fourcc, 1))
+		return CONVERT_REDUCE;
+
+	if (fourcc_depth(fourcc) && output == fourcc_unpacked(fourcc, 0))
+		return CONVERT_UNPACK;
+
+#ifndef USE_LIBV4L
+	if (fourcc == V4L2_PIX_FMT_YUYV && output == V4L2_PIX_FMT_RGB24)
+		return CONVERT_YUYV;
+#endif
+	return -1;
+}
+
+/* Best of a few runs converting a frame, in nanoseconds per pixel */
+static double negotiate_time(struct frame *frame, int copy,
+			     unsigned char *dst)
+{
+	int run;
+	unsigned int y;
+	double start = 0;
+	double best = 0;
+	size_t pixels = (size_t)frame->rect.width * frame->rect.height;
+
+	for (run = 0; run < 3; run++) {
+		start = monotonic_now();
+		for (y = 0; y < frame->rect.height; y++) {
+			if (copy)
+				memcpy(dst, frame_row(frame, y),
+				       frame->rect.width *
+				       fourcc_bpp(frame->fourcc));
+			else
+				frame_convert_row(frame, y, dst);
+		}
+		start = monotonic_now() - start;
+		if (!run || start < best)
+			best = start;
+	}
+
+	return best * 1e9 / pixels;
+}
+
+static int negotiate_calibrate(video_device *videodev, double *costs)
+{
+	int i;
+	int ret = -1;
+	struct frame frame;
+	struct demosaic *demosaic = NULL;
+	unsigned char *src = NULL;
+	unsigned char *dst = NULL;
+	static const __u32 fourccs[] = {
+		[CONVERT_COPY] = V4L2_PIX_FMT_RGB24,
+		[CONVERT_YUYV] = V4L2_PIX_FMT_YUYV,
+		[CONVERT_DEMOSAIC] = V4L2_PIX_FMT_SRGGB8,
+		[CONVERT_UNPACK] = V4L2_PIX_FMT_Y10P,
+		[CONVERT_REDUCE] = V4L2_PIX_FMT_Y16,
+	};
+
+	src = malloc(CALIBRATE_WIDTH * CALIBRATE_HEIGHT * 3);
+	dst = malloc(CALIBRATE_WIDTH * 3);
+	demosaic = demosaic_new(videodev->demosaic ?
+				videodev->demosaic->method :
+				DEMOSAIC_BILINEAR, 1);
+	if (!src || !dst || !demosaic) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	/* Noise, so no branch is always taken */
+	for (i = 0; i < CALIBRATE_WIDTH * CALIBRATE_HEIGHT * 3; i++)
+		src[i] = (i * 2654435761u) >> 24;
+
+	for (i = 0; i < (int)ARRAY_SIZE(fourccs); i++) {
+		CLEAR(frame);
+		frame.data = src;
+		frame.fourcc = fourccs[i];
+		frame.width = CALIBRATE_WIDTH;
+		frame.height = CALIBRATE_HEIGHT;
+		frame.stride = fourcc_row_bytes(frame.fourcc, frame.width);
+		frame.size = (size_t)frame.stride * frame.height;
+		frame.rect.width = frame.width;
+		frame.rect.height = frame.height;
+		frame.to_8bit = i == CONVERT_REDUCE;
+
+		if (i == CONVERT_DEMOSAIC) {
+			frame.bayer = demosaic->lanes;
+			if (demosaic_lane_begin(frame.bayer, &frame))
+				goto out;
+		}
+
+		costs[i] = negotiate_time(&frame, i == CONVERT_COPY, dst);
+	}
+
+	/* libv4l cannot be run without a device, scale its costs by the
+	 * speed of this machine */
+	costs[CONVERT_LIBV4L] = convert_costs[CONVERT_LIBV4L] *
+		costs[CONVERT_YUYV] / convert_costs[CONVERT_YUYV];
+	costs[CONVERT_JPEG] = convert_costs[CONVERT_JPEG] *
+		costs[CONVERT_YUYV] / convert_costs[CONVERT_YUYV];
+	ret = 0;
+
+out:
+	demosaic_free(demosaic);
+	free(src);
+	free(dst);
+	return ret;
+}
+
+/* Frame interval meeting the minimum rate, the slowest doing so, or the
+ * fastest without minimum. 0/0 when the driver does not tell. */
+static int negotiate_interval(video_device *videodev, __u32 fourcc,
+			      unsigned int width, unsigned int height,
+			      double min_fps, struct v4l2_fract *interval)
+{
+	double fps = 0;
+	double best = 0;
+	struct v4l2_frmivalenum frmival;
+
+	CLEAR(frmival);
+	CLEAR(*interval);
+	frmival.pixel_format = fourcc;
+	frmival.width = width;
+	frmival.height = height;
+
+	while (!video_device_ioctl(videodev, VIDIOC_ENUM_FRAMEINTERVALS,
+				   &frmival)) {
+		/* The fastest interval of a range */
+		struct v4l2_fract *fract = &frmival.discrete;
+
+		if (frmival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+			fract = &frmival.stepwise.min;
+
+		if (fract->numerator && fract->denominator) {
+			fps = fract2fps(fract);
+			if (fps >= min_fps &&
+			    (!best || (min_fps > 0 ? fps < best : fps > best))) {
+				best = fps;
+				*interval = *fract;
+			}
+		}
+
+		if (frmival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+			break;
+		frmival.index++;
+	}
+
+	if (!frmival.index && !frmival.type)
+		return min_fps > 0 ? -1 : 0;
+
+	return best ? 0 : -1;
+}
+
+static void negotiate_candidate(video_device *videodev,
+				struct negotiation *nego, __u32 fourcc,
+				int conversion, unsigned int width,
+				unsigned int height)
+{
+	double cost = 0;
+	struct v4l2_fract interval;
+
+	if (negotiate_interval(videodev, fourcc, width, height, nego->min_fps,
+			       &interval))
+		return;
+
+	cost = (double)width * height * nego->costs[conversion] / 1e9;
+	if (nego->found && cost >= nego->cost)
+		return;
+
+	nego->found = 1;
+	nego->fourcc = fourcc;
+	nego->conversion = conversion;
+	nego->best_width = width;
+	nego->best_height = height;
+	nego->interval = interval;
+	nego->cost = cost;
+}
+
+/* Smallest sizes of the format covering the request */
+static void negotiate_sizes(video_device *videodev, struct negotiation *nego,
+			    __u32 fourcc, int conversion)
+{
+	unsigned int width = 0;
+	unsigned int height = 0;
+	struct v4l2_frmsizeenum frmsize;
+
+	CLEAR(frmsize);
+	frmsize.pixel_format = fourcc;
+
+	while (!video_device_ioctl(videodev, VIDIOC_ENUM_FRAMESIZES,
+				   &frmsize)) {
+		if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			if (frmsize.discrete.width >= nego->width &&
+			    frmsize.discrete.height >= nego->height)
+				negotiate_candidate(videodev, nego, fourcc,
+						    conversion,
+						    frmsize.discrete.width,
+						    frmsize.discrete.height);
+			frmsize.index++;
+			continue;
+		}
+
+		/* Ranges: the request rounded up to the steps */
+		width = nego->width < frmsize.stepwise.min_width ?
+			frmsize.stepwise.min_width : nego->width;
+		height = nego->height < frmsize.stepwise.min_height ?
+			frmsize.stepwise.min_height : nego->height;
+		if (frmsize.type == V4L2_FRMSIZE_TYPE_STEPWISE) {
+			unsigned int step_x = frmsize.stepwise.step_width ?
+				frmsize.stepwise.step_width : 1;
+			unsigned int step_y = frmsize.stepwise.step_height ?
+				frmsize.stepwise.step_height : 1;
+
+			width = frmsize.stepwise.min_width +
+				(width - frmsize.stepwise.min_width +
+				 step_x - 1) / step_x * step_x;
+			height = frmsize.stepwise.min_height +
+				(height - frmsize.stepwise.min_height +
+				 step_y - 1) / step_y * step_y;
+		}
+
+		if (width <= frmsize.stepwise.max_width &&
+		    height <= frmsize.stepwise.max_height)
+			negotiate_candidate(videodev, nego, fourcc, conversion,
+					    width, height);
+		return;
+	}
+
+	/* Not enumerated, the driver adjusts the size when it is set */
+	if (!frmsize.index)
+		negotiate_candidate(videodev, nego, fourcc, conversion,
+				    nego->width, nego->height);
+}
+
+static int negotiate_apply(video_device *videodev, struct negotiation *nego)
+{
+	struct v4l2_format format;
+	struct v4l2_streamparm parm;
+
+	CLEAR(format);
+	format.type = videodev->type;
+
+	if (video_device_ioctl(videodev, VIDIOC_G_FMT, &format))
+		goto error;
+
+	format.fmt.pix.pixelformat = nego->fourcc;
+	format.fmt.pix.width = nego->best_width;
+	format.fmt.pix.height = nego->best_height;
+	format.fmt.pix.field = V4L2_FIELD_ANY;
+	format.fmt.pix.bytesperline = 0;
+
+	if (video_device_ioctl(videodev, VIDIOC_S_FMT, &format))
+		goto error;
+
+	videodev->pix = format.fmt.pix;
+	CLEAR(videodev->crop);
+	nego->best_width = format.fmt.pix.width;
+	nego->best_height = format.fmt.pix.height;
+
+	/* Not every driver sets its rate */
+	if (nego->interval.denominator) {
+		CLEAR(parm);
+		parm.type = videodev->type;
+		if (videodev->type & V4L2_TYPE_CAPTURE)
+			parm.parm.capture.timeperframe = nego->interval;
+		else
+			parm.parm.output.timeperframe = nego->interval;
+
+		if (video_device_ioctl(videodev, VIDIOC_S_PARM, &parm) &&
+		    errno != ENOTTY)
+			goto error;
+	}
+
+	if (nego->conversion == CONVERT_DEMOSAIC && !videodev->demosaic) {
+		videodev->demosaic = demosaic_new(DEMOSAIC_BILINEAR, 1);
+		if (!videodev->demosaic) {
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+
+	if (nego->conversion == CONVERT_REDUCE)
+		videodev->depth = 8;
+	else if (nego->conversion == CONVERT_UNPACK)
+		videodev->depth = 16;
+
+	return 0;
+
+error:
+	PyErr_SetFromErrno(PyExc_IOError);
+	return -1;
+}
+
+static PyObject *video_device_negotiate_format(video_device *videodev,
+					       PyObject *args,
+					       PyObject *keywds)
+{
+	int calibrate = 0;
+	int apply = 1;
+	int conversion = 0;
+	int compressed_only = 1;
+	double fps = 0;
+	const char *output = "RGB3";
+	char rate[32];
+	struct negotiation nego;
+	struct v4l2_fmtdesc format;
+	static char *kwlist[] = {
+		"size_x",
+		"size_y",
+		"min_fps",
+		"output",
+		"calibrate",
+		"apply",
+		NULL
+	};
+
+	CLEAR(nego);
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "II|dspp", kwlist,
+					 &nego.width, &nego.height,
+					 &nego.min_fps, &output, &calibrate,
+					 &apply))
+		return NULL;
+
+	if (str2fourcc(output, strlen(output), &nego.output))
+		return NULL;
+
+	memcpy(nego.costs, convert_costs, sizeof(nego.costs));
+	if (calibrate && negotiate_calibrate(videodev, nego.costs))
+		return NULL;
+
+	/* libv4l decodes from a compressed format only if it has to */
+	CLEAR(format);
+	format.type = videodev->type;
+	while (!video_device_ioctl(videodev, VIDIOC_ENUM_FMT, &format)) {
+		if (!(format.flags & V4L2_FMT_FLAG_EMULATED) &&
+		    !(format.flags & V4L2_FMT_FLAG_COMPRESSED))
+			compressed_only = 0;
+		format.index++;
+	}
+
+	CLEAR(format);
+	format.type = videodev->type;
+	while (!video_device_ioctl(videodev, VIDIOC_ENUM_FMT, &format)) {
+		if (!(format.flags & V4L2_FMT_FLAG_EMULATED))
+			conversion = negotiate_conversion(format.pixelformat,
+							  nego.output);
+		else if (format.pixelformat == nego.output)
+			conversion = compressed_only ? CONVERT_JPEG :
+				CONVERT_LIBV4L;
+		else
+			conversion = -1;
+
+		if (conversion >= 0)
+			negotiate_sizes(videodev, &nego, format.pixelformat,
+					conversion);
+		format.index++;
+	}
+
+	if (!nego.found) {
+		/* PyErr_Format knows no floats */
+		PyOS_snprintf(rate, sizeof(rate), "%g", nego.min_fps);
+		return PyErr_Format(PyExc_ValueError, "No format gives %s at "
+				    "%ux%u and %s fps", output, nego.width,
+				    nego.height, rate);
+	}
+
+	if (apply && negotiate_apply(videodev, &nego))
+		return NULL;
+
+	if (nego.interval.denominator)
+		fps = fract2fps(&nego.interval);
+
+	return Py_BuildValue("{s:i, s:(II), s:d, s:d, s:s}",
+			     "fourcc", nego.fourcc,
+			     "size", nego.best_width, nego.best_height,
+			     "fps", fps,
+			     "cost", nego.cost,
+			     "conversion", convert_names[nego.conversion]);
+}
+
+static PyObject *video_device_set_decimation(video_device *videodev,
+					     PyObject *args, PyObject *keywds)
+{
+	int every = 1;
+	double interval = 0;
+	static char *kwlist[] = {
+		"every",
+		"interval",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|id", kwlist,
+					 &every, &interval))
+		return NULL;
+
+	if (every < 1 || interval < 0)
+		return PyErr_Format(PyExc_ValueError, "Invalid decimation");
+
+	videodev->decimate = every;
+	videodev->decimate_count = 0;
+	videodev->interval = interval;
+	videodev->next_due = 0;
+
+	Py_RETURN_NONE;
+}
+
+static int video_device_set_selection(video_device *videodev,
+				      struct v4l2_rect *rect)
+{
+	struct v4l2_selection sel;
+
+	CLEAR(sel);
+	sel.type = videodev->type;
+	sel.target = V4L2_SEL_TGT_CROP;
+
+	if (!rect->width) {
+		sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+		if (video_device_ioctl(videodev, VIDIOC_G_SELECTION, &sel))
+			return -1;
+		sel.target = V4L2_SEL_TGT_CROP;
+	} else {
+		sel.r = *rect;
+	}
+
+	if (video_device_ioctl(videodev, VIDIOC_S_SELECTION, &sel))
+		return -1;
+
+	*rect = sel.r;
+	return 0;
+}
+
+static PyObject *video_device_set_crop(video_device *videodev,
+				       PyObject *args)
+{
+	unsigned int align_x = 1;
+	unsigned int align_y = 1;
+	struct v4l2_rect rect;
+
+	CLEAR(rect);
+
+	if (!PyArg_ParseTuple(args, "|iiII", &rect.left, &rect.top,
+			      &rect.width, &rect.height))
+		return NULL;
+
+	CLEAR(videodev->crop);
+
+	/* Let the driver crop if it can, it also saves bandwidth */
+	if (!video_device_set_selection(videodev, &rect)) {
+		if (video_device_refresh_format(videodev))
+			return NULL;
+
+		return Py_BuildValue("iiII", rect.left, rect.top,
+				     rect.width, rect.height);
+	}
+
+	if (!rect.width)
+		Py_RETURN_NONE;
+
+	if (video_device_refresh_format(videodev))
+		return NULL;
+
+	if (fourcc_crop_align(videodev->pix.pixelformat, &align_x, &align_y))
+		return PyErr_Format(PyExc_ValueError, "The device does not "
+				    "support cropping and the format can not "
+				    "be cropped natively");
+
+	if (rect.left < 0 || rect.top < 0 ||
+	    (unsigned int)rect.left > videodev->pix.width ||
+	    rect.width > videodev->pix.width - rect.left ||
+	    (unsigned int)rect.top > videodev->pix.height ||
+	    rect.height > videodev->pix.height - rect.top)
+		return PyErr_Format(PyExc_ValueError, "Crop rectangle is "
+				    "outside of the %ux%u frame",
+				    videodev->pix.width, videodev->pix.height);
+
+	rect.left -= rect.left % align_x;
+	rect.top -= rect.top % align_y;
+	rect.width -= rect.width % align_x;
+	rect.height -= rect.height % align_y;
+
+	if (!rect.width || !rect.height)
+		return PyErr_Format(PyExc_ValueError, "Crop rectangle is "
+				    "empty");
+
+	videodev->crop = rect;
+
+	return Py_BuildValue("iiII", rect.left, rect.top, rect.width,
+			     rect.height);
+}
+
+static PyObject *video_device_set_motion_gate(video_device *videodev,
+					      PyObject *args,
+					      PyObject *keywds)
+{
+	int step = 8;
+	double threshold = 0;
+	double heartbeat = 0;
+	struct motion_gate *gate = NULL;
+	static char *kwlist[] = {
+		"threshold",
+		"heartbeat",
+		"step",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|ddi", kwlist,
+					 &threshold, &heartbeat, &step))
+		return NULL;
+
+	if (step < 1 || threshold < 0 || heartbeat < 0)
+		return PyErr_Format(PyExc_ValueError, "Invalid motion gate");
+
+	motion_gate_free(videodev->gate);
+	videodev->gate = NULL;
+
+	if (!threshold)
+		Py_RETURN_NONE;
+
+	if (0 == (gate = calloc(1, sizeof(*gate))))
+		return PyErr_NoMemory();
+
+	gate->step = step;
+	gate->threshold = threshold;
+	gate->heartbeat = heartbeat;
+	videodev->gate = gate;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_get_motion_score(video_device *videodev)
+{
+	if (!videodev->gate)
+		Py_RETURN_NONE;
+
+	return PyFloat_FromDouble(videodev->gate->score);
+}
+
+static PyObject *video_device_set_frame_stats(video_device *videodev,
+					      PyObject *args,
+					      PyObject *keywds)
+{
+	int enabled = 1;
+	int step = 4;
+	static char *kwlist[] = {
+		"enabled",
+		"step",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|ii", kwlist,
+					 &enabled, &step))
+		return NULL;
+
+	if (step < 1)
+		return PyErr_Format(PyExc_ValueError, "Invalid step %d", step);
+
+	frame_stats_free(videodev->stats);
+	videodev->stats = NULL;
+
+	if (!enabled)
+		Py_RETURN_NONE;
+
+	if (0 == (videodev->stats = calloc(1, sizeof(struct frame_stats))))
+		return PyErr_NoMemory();
+
+	videodev->stats->step = step;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_get_frame_stats(video_device *videodev)
+{
+	if (!videodev->stats)
+		Py_RETURN_NONE;
+
+	return frame_stats_to_dict(videodev->stats);
+}
+
+static PyObject *video_device_publish(video_device *videodev,
+				      PyObject *args, PyObject *keywds)
+{
+	int slots = 4;
+	Py_ssize_t slot_size = 0;
+	size_t max_size = 0;
+	struct shm_ring *ring = NULL;
+	static char *kwlist[] = {
+		"slots",
+		"slot_size",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|in", kwlist,
+					 &slots, &slot_size))
+		return NULL;
+
+	if (slots < 0 || slot_size < 0)
+		return PyErr_Format(PyExc_ValueError, "Invalid ring size");
+
+	shm_ring_free(videodev->ring);
+	videodev->ring = NULL;
+
+	if (!slots)
+		Py_RETURN_NONE;
+
+	if (!slot_size) {
+		if (video_device_max_output_size(videodev, &max_size))
+			return NULL;
+		slot_size = max_size;
+	}
+
+	if (0 == (ring = shm_ring_create(slots, slot_size)))
+		return NULL;
+
+	videodev->ring = ring;
+
+	return PyLong_FromLong(ring->fd);
+}
+
+static PyObject *video_device_read_and_publish(video_device *videodev)
+{
+	if (!videodev->ring)
+		return PyErr_Format(PyExc_ValueError, "Not publishing");
+
+	return video_device_read_internal(videodev, 1, NULL, 1);
+}
+
+static PyObject *video_device_get_publish_stats(video_device *videodev)
+{
+	if (!videodev->ring)
+		Py_RETURN_NONE;
+
+	return Py_BuildValue("{s:K, s:k}",
+			     "sequence",
+			     (unsigned long long)videodev->ring->seq,
+			     "dropped", videodev->ring->dropped);
+}
+
+static PyObject *video_device_set_flight_recorder(video_device *videodev,
+						  PyObject *args)
+{
+	Py_ssize_t size = 0;
+	struct recorder *recorder = NULL;
+
+	if (!PyArg_ParseTuple(args, "n", &size))
+		return NULL;
+
+	if (size < 0)
+		return PyErr_Format(PyExc_ValueError, "Invalid size");
+
+	recorder_free(videodev->recorder);
+	videodev->recorder = NULL;
+
+	if (!size)
+		Py_RETURN_NONE;
+
+	if (0 == (recorder = recorder_create(size, videodev->lock_buffers)))
+		return NULL;
+
+	videodev->recorder = recorder;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_dump(video_device *videodev, PyObject *args,
+				   PyObject *keywds)
+{
+	int fd = -1;
+	const char *path = NULL;
+	double before = 0;
+	double after = 0;
+	static char *kwlist[] = {
+		"path",
+		"before_s",
+		"after_s",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "sd|d", kwlist,
+					 &path, &before, &after))
+		return NULL;
+
+	if (!videodev->recorder)
+		return PyErr_Format(PyExc_ValueError, "The flight recorder is "
+				    "not enabled");
+
+	if (before < 0 || after < 0)
+		return PyErr_Format(PyExc_ValueError, "Invalid window");
+
+	if (!videodev->pix.width && video_device_refresh_format(videodev))
+		return NULL;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+
+	if (recorder_start_dump(videodev->recorder, fd, videodev->type,
+				&videodev->pix, before, after)) {
+		close(fd);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_save_snapshot(video_device *videodev,
+					    PyObject *args, PyObject *keywds)
+{
+	int ret = 0;
+	int fd = -1;
+	int format = SNAPSHOT_JPEG;
+	int quality = 90;
+	__u32 fourcc = 0;
+	char code[5];
+	const char *path = NULL;
+	const char *format_name = "jpeg";
+	snapshot_future *future = NULL;
+	struct snapshot_job *job = NULL;
+	struct v4l2_buffer buffer;
+	struct frame frame;
+	static char *kwlist[] = {
+		"path",
+		"format",
+		"quality",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "s|si", kwlist,
+					 &path, &format_name, &quality))
+		return NULL;
+
+	if (!strcmp(format_name, "png"))
+		format = SNAPSHOT_PNG;
+	else if (strcmp(format_name, "jpeg") && strcmp(format_name, "jpg"))
+		return PyErr_Format(PyExc_ValueError, "Unknown snapshot "
+				    "format '%s'", format_name);
+
+	if (quality < 1 || quality > 100)
+		return PyErr_Format(PyExc_ValueError, "Invalid quality %d",
+				    quality);
+
+	if (video_device_check_snapshots(videodev))
+		return NULL;
+
+	if (!videodev->snapshots &&
+	    !(videodev->snapshots = snapshots_create()))
+		return NULL;
+
+	ret = video_device_next_frame(videodev, 1, &buffer, &frame);
+	if (ret <= 0) {
+		if (ret < 0)
+			return NULL;
+		Py_RETURN_NONE;
+	}
+
+	/* JPEG frames are written as they are, never decoded */
+	fourcc = snapshot_fourcc(&frame);
+	if (frame_is_compressed(&frame)) {
+		if (format != SNAPSHOT_JPEG ||
+		    (frame.fourcc != V4L2_PIX_FMT_MJPEG &&
+		     frame.fourcc != V4L2_PIX_FMT_JPEG))
+			goto unsupported;
+	} else if (format == SNAPSHOT_JPEG) {
+#ifndef USE_LIBJPEG
+		PyErr_SetString(PyExc_ValueError, "JPEG encoding needs "
+				"libjpeg (USE_LIBJPEG)");
+		goto requeue;
+#endif
+		if (fourcc != V4L2_PIX_FMT_RGB24 &&
+		    fourcc != V4L2_PIX_FMT_BGR24 &&
+		    fourcc != V4L2_PIX_FMT_GREY)
+			goto unsupported;
+	} else {
+#ifndef USE_LIBPNG
+		PyErr_SetString(PyExc_ValueError, "PNG encoding needs "
+				"libpng (USE_LIBPNG)");
+		goto requeue;
+#endif
+		if (fourcc != V4L2_PIX_FMT_RGB24 &&
+		    fourcc != V4L2_PIX_FMT_BGR24 &&
+		    fourcc != V4L2_PIX_FMT_GREY &&
+		    !snapshot_is_grey16(fourcc))
+			goto unsupported;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		PyErr_NoMemory();
+		goto requeue;
+	}
+
+	job->frame = frame;
+	job->index = buffer.index;
+	job->format = format;
+	job->quality = quality;
+	job->fd = -1;
+
+	/* The lanes of the device belong to the reading threads */
+	if (frame.bayer) {
+		job->lane.pool = frame.bayer->pool;
+		job->frame.bayer = &job->lane;
+		if (demosaic_lane_begin(&job->lane, &job->frame))
+			goto requeue;
+	}
+
+	job->result = snapshot_result_new();
+	if (!job->result) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		goto requeue;
+	}
+
+	future = PyObject_New(snapshot_future,
+			      module_state_of(Py_TYPE(videodev))->
+			      snapshot_future_type);
+	if (!future)
+		goto requeue;
+
+	future->result = job->result;
+	future->path = PyUnicode_FromString(path);
+	if (!future->path)
+		goto requeue;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+		goto requeue;
+	}
+	job->fd = fd;
+
+	snapshots_submit(videodev->snapshots, job);
+	return (PyObject *)future;
+
+unsupported:
+	PyErr_Format(PyExc_ValueError, "Cannot write %s frames as %s",
+		     fourcc2str(fourcc, code),
+		     format == SNAPSHOT_PNG ? "PNG" : "JPEG");
+requeue:
+	video_device_ioctl(videodev, VIDIOC_QBUF, &buffer);
+	if (job) {
+		demosaic_lane_free(&job->lane);
+		/* The reference of the job, the future holds the other */
+		snapshot_result_unref(job->result);
+		if (!future)
+			snapshot_result_unref(job->result);
+		free(job);
+	}
+	Py_XDECREF(future);
+	return NULL;
+}
+
+static PyObject *video_device_start_recording(video_device *videodev,
+					      PyObject *args)
+{
+	const char *path = NULL;
+
+	if (!PyArg_ParseTuple(args, "s", &path))
+		return NULL;
+
+	if (videodev->capture)
+		return PyErr_Format(PyExc_ValueError, "Already recording");
+
+	if (video_device_refresh_format(videodev))
+		return NULL;
+
+	videodev->capture = capture_create(path, videodev->type,
+					   &videodev->pix);
+	if (!videodev->capture)
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_stop_recording(video_device *videodev)
+{
+	int error = 0;
+	unsigned long long frames = 0;
+
+	if (!videodev->capture)
+		return PyErr_Format(PyExc_ValueError, "Not recording");
+
+	frames = videodev->capture->frames;
+	error = capture_close(videodev->capture);
+	videodev->capture = NULL;
+
+	if (error) {
+		errno = error;
+		return PyErr_SetFromErrno(PyExc_IOError);
+	}
+
+	return PyLong_FromUnsignedLongLong(frames);
+}
+
+static PyObject *video_device_get_recorder_stats(video_device *videodev)
+{
+	PyObject *stats = NULL;
+	struct recorder *recorder = videodev->recorder;
+
+	if (!recorder)
+		Py_RETURN_NONE;
+
+	pthread_mutex_lock(&recorder->lock);
+	stats = Py_BuildValue("{s:k, s:K, s:K, s:O, s:K, s:i}",
+			      "frames", recorder->records,
+			      "recorded", recorder->recorded,
+			      "dropped", recorder->dropped,
+			      "dumping", recorder->dumping ? Py_True : Py_False,
+			      "dumped", recorder->dumped,
+			      "error", recorder->error);
+	pthread_mutex_unlock(&recorder->lock);
+
+	return stats;
+}
+
+static PyObject *video_device_wait(video_device *videodev, PyObject *args)
+{
+	int ret = 0;
+	double timeout = -1;
+	struct pollfd pfd;
+
+	if (!PyArg_ParseTuple(args, "|d", &timeout))
+		return NULL;
+
+	if (thread_setup_apply(&videodev->thread))
+		return NULL;
+
+	video_device_requeue_snapshots(videodev);
+
+	pfd.fd = videodev->fd;
+	pfd.events = videodev->type & V4L2_TYPE_CAPTURE ? POLLIN : POLLOUT;
+	pfd.revents = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = poll(&pfd, 1, timeout < 0 ? -1 : (int)(timeout * 1000));
+	Py_END_ALLOW_THREADS
+
+	if (ret < 0) {
+		if (errno == EINTR && !PyErr_CheckSignals())
+			Py_RETURN_FALSE;
+		return PyErr_SetFromErrno(PyExc_IOError);
+	}
+
+	return PyBool_FromLong(ret > 0);
+}
+
+static PyObject *video_device_set_thread_affinity(video_device *videodev,
+						  PyObject *args)
+{
+	long cpu = 0;
+	PyObject *cpus = Py_None;
+	PyObject *iter = NULL;
+	PyObject *item = NULL;
+	cpu_set_t allowed;
+	cpu_set_t wanted;
+	struct thread_setup *setup = &videodev->thread;
+
+	if (!PyArg_ParseTuple(args, "|O", &cpus))
+		return NULL;
+
+	CPU_ZERO(&wanted);
+
+	if (cpus == Py_None) {
+		setup->has_affinity = 0;
+		goto changed;
+	}
+
+	/* The CPUs of this thread before any setup was applied */
+	if (thread_state.saved)
+		allowed = thread_state.cpus;
+	else if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return PyErr_SetFromErrno(PyExc_OSError);
+
+	if (0 == (iter = PyObject_GetIter(cpus)))
+		return NULL;
+
+	while ((item = PyIter_Next(iter))) {
+		cpu = PyLong_AsLong(item);
+		Py_DECREF(item);
+
+		if (cpu < 0 || cpu >= CPU_SETSIZE ||
+		    !CPU_ISSET(cpu, &allowed)) {
+			Py_DECREF(iter);
+			if (!PyErr_Occurred())
+				PyErr_Format(PyExc_ValueError, "Invalid CPU %ld",
+					     cpu);
+			return NULL;
+		}
+
+		CPU_SET(cpu, &wanted);
+	}
+	Py_DECREF(iter);
+
+	if (PyErr_Occurred())
+		return NULL;
+
+	if (!CPU_COUNT(&wanted))
+		return PyErr_Format(PyExc_ValueError, "No CPU given");
+
+	setup->has_affinity = 1;
+	setup->cpus = wanted;
+
+changed:
+	if (thread_setup_changed(setup))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_set_thread_scheduling(video_device *videodev,
+						    PyObject *args)
+{
+	int policy = SCHED_OTHER;
+	int priority = 0;
+	struct thread_setup *setup = &videodev->thread;
+
+	if (!PyArg_ParseTuple(args, "|ii", &policy, &priority))
+		return NULL;
+
+	if (policy != SCHED_OTHER && policy != SCHED_FIFO &&
+	    policy != SCHED_RR)
+		return PyErr_Format(PyExc_ValueError, "Unsupported policy %d",
+				    policy);
+
+	if (priority < sched_get_priority_min(policy) ||
+	    priority > sched_get_priority_max(policy))
+		return PyErr_Format(PyExc_ValueError, "Priority %d is out of "
+				    "the %d to %d range of the policy",
+				    priority, sched_get_priority_min(policy),
+				    sched_get_priority_max(policy));
+
+	/* The defaults give the threads their own scheduling back */
+	setup->has_sched = policy != SCHED_OTHER;
+	setup->policy = policy;
+	setup->priority = priority;
+	if (thread_setup_changed(setup))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_set_lock_buffers(video_device *videodev,
+					       PyObject *args)
+{
+	int lock = 1;
+
+	if (!PyArg_ParseTuple(args, "|i", &lock))
+		return NULL;
+
+	if (videodev->buffers)
+		return PyErr_Format(PyExc_ValueError, "Buffers are "
+				    "already created");
+
+	videodev->lock_buffers = lock;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_get_timing_stats(video_device *videodev)
+{
+	struct timing_stats *timing = &videodev->timing;
+
+	if (!timing->frames)
+		Py_RETURN_NONE;
+
+	return Py_BuildValue("{s:K, s:d, s:d, s:d, s:d}",
+			     "frames", timing->frames,
+			     "latency_mean", timing->mean,
+			     "latency_min", timing->min,
+			     "latency_max", timing->max,
+			     "jitter", sqrt(timing->m2 / timing->frames));
+}
+
+static PyObject *video_device_reset_timing_stats(video_device *videodev)
+{
+	memset(&videodev->timing, 0, sizeof(videodev->timing));
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *video_device_set_helper(int id,
+					 video_device *videodev,
+					 PyObject *args)
+{
+	int value = 0;
+	struct v4l2_control ctrl;
+
+	CLEAR(ctrl);
+
+	if (0 > id)
+		Py_RETURN_NONE;
+
+	if (!PyArg_ParseTuple(args, "i", &value))
+		Py_RETURN_NONE;
+
+	ctrl.id = id;
+	ctrl.value = value;
+
+	if (video_device_ioctl(videodev, VIDIOC_S_CTRL, &ctrl))
+		Py_RETURN_NONE;
+
+	return Py_BuildValue("i", ctrl.value);
+}
+
+static PyObject *video_device_get_helper(int id,
+					 video_device *videodev)
+{
+	struct v4l2_control ctrl;
+
+	CLEAR(ctrl);
+	ctrl.id = id;
+
+	if (video_device_ioctl(videodev, VIDIOC_G_CTRL, &ctrl))
+		Py_RETURN_NONE;
+
+	return Py_BuildValue("i", ctrl.value);
+}
+
+DECLARE_METHODS(auto_wb, V4L2_CID_AUTO_WHITE_BALANCE);
+DECLARE_METHODS(wb_temperature, V4L2_CID_WHITE_BALANCE_TEMPERATURE);
+DECLARE_METHODS(exposure_absolute, V4L2_CID_EXPOSURE_ABSOLUTE);
+DECLARE_METHODS(exposure_auto, V4L2_CID_EXPOSURE_AUTO);
+DECLARE_METHODS(focus_auto, V4L2_CID_FOCUS_AUTO);
+
+LOCKED_NOARGS(video_device_open, video_device);
+LOCKED_NOARGS(video_device_close, video_device);
+LOCKED_NOARGS(video_device_fileno, video_device);
+LOCKED_NOARGS(video_device_get_info, video_device);
+LOCKED_NOARGS(video_device_get_formats, video_device);
+LOCKED_NOARGS(video_device_get_format, video_device);
+LOCKED_KEYWORDS(video_device_set_format, video_device);
+LOCKED_VARARGS(video_device_set_fps, video_device);
+LOCKED_VARARGS(video_device_set_auto_wb, video_device);
+LOCKED_NOARGS(video_device_get_auto_wb, video_device);
+LOCKED_VARARGS(video_device_set_wb_temperature, video_device);
+LOCKED_NOARGS(video_device_get_wb_temperature, video_device);
+LOCKED_VARARGS(video_device_set_exposure_auto, video_device);
+LOCKED_NOARGS(video_device_get_exposure_auto, video_device);
+LOCKED_VARARGS(video_device_set_exposure_absolute, video_device);
+LOCKED_NOARGS(video_device_get_exposure_absolute, video_device);
+LOCKED_VARARGS(video_device_set_focus_auto, video_device);
+LOCKED_NOARGS(video_device_get_focus_auto, video_device);
+LOCKED_VARARGS(video_device_get_framesizes, video_device);
+LOCKED_VARARGS(video_device_get_frameintervals, video_device);
+LOCKED_NOARGS(video_device_start, video_device);
+LOCKED_NOARGS(video_device_stop, video_device);
+LOCKED_VARARGS(video_device_create_buffers, video_device);
+LOCKED_NOARGS(video_device_queue_all_buffers, video_device);
+LOCKED_NOARGS(video_device_export_buffers, video_device);
+LOCKED_KEYWORDS(video_device_set_decimation, video_device);
+LOCKED_VARARGS(video_device_set_crop, video_device);
+LOCKED_KEYWORDS(video_device_set_scale, video_device);
+LOCKED_KEYWORDS(video_device_set_demosaic, video_device);
+LOCKED_VARARGS(video_device_set_depth, video_device);
+LOCKED_KEYWORDS(video_device_negotiate_format, video_device);
+LOCKED_VARARGS(video_device_set_flight_recorder, video_device);
+LOCKED_KEYWORDS(video_device_dump, video_device);
+LOCKED_NOARGS(video_device_get_recorder_stats, video_device);
+LOCKED_KEYWORDS(video_device_save_snapshot, video_device);
+LOCKED_VARARGS(video_device_start_recording, video_device);
+LOCKED_NOARGS(video_device_stop_recording, video_device);
+LOCKED_KEYWORDS(video_device_set_motion_gate, video_device);
+LOCKED_NOARGS(video_device_get_motion_score, video_device);
+LOCKED_KEYWORDS(video_device_set_frame_stats, video_device);
+LOCKED_NOARGS(video_device_get_frame_stats, video_device);
+LOCKED_KEYWORDS(video_device_publish, video_device);
+LOCKED_NOARGS(video_device_read_and_publish, video_device);
+LOCKED_NOARGS(video_device_get_publish_stats, video_device);
+LOCKED_VARARGS(video_device_wait, video_device);
+LOCKED_VARARGS(video_device_set_thread_affinity, video_device);
+LOCKED_VARARGS(video_device_set_thread_scheduling, video_device);
+LOCKED_VARARGS(video_device_set_lock_buffers, video_device);
+LOCKED_NOARGS(video_device_get_timing_stats, video_device);
+LOCKED_NOARGS(video_device_reset_timing_stats, video_device);
+LOCKED_NOARGS(video_device_read, video_device);
+LOCKED_NOARGS(video_device_read_and_queue, video_device);
+LOCKED_VARARGS(video_device_read_into, video_device);
+
+static PyMethodDef video_device_methods[] = {
+	{
+		"open", (PyCFunction)video_device_open_locked, METH_NOARGS,
+		"open()\n\n"
+		"Open the video device."
+	},
+	{
+		"close", (PyCFunction)video_device_close_locked, METH_NOARGS,
+		"close()\n\n"
+		"Close the video device."},
+	{
+		"fileno", (PyCFunction)video_device_fileno_locked, METH_NOARGS,
+		"fileno() -> fd\n\n"
+		"Returns the file descriptor of the video device, so the "
+		"object can be passed to select.select."
+	},
+	{
+		"get_info", (PyCFunction)video_device_get_info_locked, METH_NOARGS,
 		"get_info() -> driver, card, bus_info, capabilities\n\n"
 		"Returns three strings with information about the video "
 		"device, and one set containing strings identifying the "
 		"capabilities of the video device."
 	},
 	{
-		"get_formats", (PyCFunction)video_device_get_formats,
-		METH_NOARGS,
-		"get_formats() -> list of dict{'type', 'fourcc', "
-		"'desc'} for each available format.\n\n"
-		"Request the available video format."
+		"get_formats", (PyCFunction)video_device_get_formats_locked,
+		METH_NOARGS,
+		"get_formats() -> list of dict{'type', 'fourcc', "
+		"'desc'} for each available format.\n\n"
+		"Request the available video format."
+	},
+	{
+		"get_format", (PyCFunction)video_device_get_format_locked,
+		METH_NOARGS,
+		"get_format() -> size_x, size_y, fourcc\n\n"
+		"Request the current video format."
+	},
+	{
+		"set_format", (PyCFunction)video_device_set_format_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_format(size_x, size_y, yuv420 = 0, fourcc='MJPEG') -> "
+		"size_x, size_y\n\n"
+		"Request the video device to set image size and format. "
+		"The device may choose another size than requested and will "
+		"return its choice. "
+		"The image format will be RGB24 if yuv420 is zero (default) "
+		"or YUV420 if yuv420 is 1, if fourcc keyword is set that will "
+		"be the fourcc pixel format used."
+	},
+	{
+		"set_fps", (PyCFunction)video_device_set_fps_locked, METH_VARARGS,
+		"set_fps(fps) -> fps \n\n"
+		"Request the video device to set frame per seconds.The device "
+		"may choose another frame rate than requested and will return "
+		"its choice. "
+	},
+	{
+		"set_auto_white_balance",
+		(PyCFunction)video_device_set_auto_wb_locked, METH_VARARGS,
+		"set_auto_white_balance(autowb) -> autowb \n\n"
+		"Request the video device to set auto white balance to value. "
+		"The device may choose another value than requested and will "
+		"return its choice. "
+	},
+	{
+		"get_auto_white_balance",
+		(PyCFunction)video_device_get_auto_wb_locked, METH_NOARGS,
+		"get_auto_white_balance() -> autowb \n\n"
+		"Request the video device to get auto white balance value. "
+	},
+	{
+		"set_white_balance_temperature",
+		(PyCFunction)video_device_set_wb_temperature_locked, METH_VARARGS,
+		"set_white_balance_temperature(temp) -> temp \n\n"
+		"Request the video device to set white balance tempature to "
+		"value. The device may choose another value than requested "
+		"and will return its choice. "
+	},
+	{
+		"get_white_balance_temperature",
+		(PyCFunction)video_device_get_wb_temperature_locked, METH_NOARGS,
+		"get_white_balance_temperature() -> temp \n\n"
+		"Request the video device to get white balance temperature "
+		"value. "
+	},
+	{
+		"set_exposure_auto",
+		(PyCFunction)video_device_set_exposure_auto_locked,
+		METH_VARARGS,
+		"set_exposure_auto(autoexp) -> autoexp \n\n"
+		"Request the video device to set auto exposure to value. The "
+		"device may choose another value than requested and will "
+		"return its choice. "
+	},
+	{
+		"get_exposure_auto",
+		(PyCFunction)video_device_get_exposure_auto_locked,
+		METH_NOARGS,
+		"get_exposure_auto() -> autoexp \n\n"
+		"Request the video device to get auto exposure value. "
+	},
+	{
+		"set_exposure_absolute",
+		(PyCFunction)video_device_set_exposure_absolute_locked,
+		METH_VARARGS,
+		"set_exposure_absolute(exptime) -> exptime \n\n"
+		"Request the video device to set exposure time to value. The "
+		"device may choose another value than requested and will "
+		"return its choice. "
+	},
+	{
+		"get_exposure_absolute",
+		(PyCFunction)video_device_get_exposure_absolute_locked,
+		METH_NOARGS,
+		"get_exposure_absolute() -> exptime \n\n"
+		"Request the video device to get exposure time value. "
+	},
+	{
+		"set_focus_auto", (PyCFunction)video_device_set_focus_auto_locked,
+		METH_VARARGS,
+		"set_auto_focus_auto(autofocus) -> autofocus \n\n"
+		"Request the video device to set auto focuse on or off. The "
+		"device may choose another value than requested and will "
+		"return its choice. "
+	},
+	{
+		"get_focus_auto", (PyCFunction)video_device_get_focus_auto_locked,
+		METH_NOARGS,
+		"get_focus_auto() -> autofocus \n\n"
+		"Request the video device to get auto focus value. "
+	},
+	{
+		"get_framesizes", (PyCFunction)video_device_get_framesizes_locked,
+		METH_VARARGS,
+		"get_framesizes() -> framesizes \n\n"
+		"Request the framesizes suported by the device. "
+	},
+	{
+		"get_frameintervals",
+		(PyCFunction)video_device_get_frameintervals_locked,
+		METH_VARARGS,
+		"get_frameintervals() -> frameintervals \n\n"
+		"Request the frameintervals suported by the device. "
+	},
+	{
+		"start", (PyCFunction)video_device_start_locked, METH_NOARGS,
+		"start()\n\n" "Start video capture."
+	},
+	{
+		"stop", (PyCFunction)video_device_stop_locked, METH_NOARGS,
+		"stop()\n\n" "Stop video capture."
+	},
+	{
+		"create_buffers", (PyCFunction)video_device_create_buffers_locked,
+		METH_VARARGS,
+		"create_buffers(count)\n\n"
+		"Create buffers used for capturing image data. Can only be "
+		"called once for each video device object."
+	},
+	{
+		"queue_all_buffers",
+		(PyCFunction)video_device_queue_all_buffers_locked,
+		METH_NOARGS,
+		"queue_all_buffers()\n\n"
+		"Let the video device fill all buffers created."
+	},
+	{
+		"export_buffers", (PyCFunction)video_device_export_buffers_locked,
+		METH_NOARGS,
+		"export_buffers() -> list of fd\n\n"
+		"Export the created buffers as DMABUF file descriptors, one "
+		"per buffer index. The caller owns the returned descriptors."
+	},
+	{
+		"set_decimation", (PyCFunction)video_device_set_decimation_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_decimation(every=1, interval=0.0)\n\n"
+		"Deliver only one frame out of 'every', and at most one frame "
+		"per 'interval' seconds according to the buffer timestamps. "
+		"The other frames are given back to the device without being "
+		"converted and 'read' returns None when only skipped frames "
+		"were available."
+	},
+	{
+		"set_crop", (PyCFunction)video_device_set_crop_locked, METH_VARARGS,
+		"set_crop(left, top, width, height) -> left, top, width, "
+		"height\n\n"
+		"Restrict the delivered frames to a region of interest. The "
+		"device crops through VIDIOC_S_SELECTION when it supports "
+		"it, otherwise the region is extracted before conversion. "
+		"The rectangle may be adjusted and is returned. Without "
+		"arguments, the full frame is restored. Setting the format "
+		"resets a natively cropped region."
+	},
+	{
+		"set_scale", (PyCFunction)video_device_set_scale_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_scale(size_x, size_y, rotation=0, filter=SCALE_BOX)\n\n"
+		"Scale the delivered frames to size_x by size_y, the size of "
+		"the image after rotation. 'rotation' is counterclockwise in "
+		"degrees, as for PIL's Image.rotate, and must be a multiple "
+		"of 90. 'filter' is SCALE_BOX (area average, best for "
+		"downscaling) or SCALE_BILINEAR. Scaling is fused with the "
+		"color conversion and needs an RGB or grey output format. "
+		"Without arguments, scaling is disabled."
+	},
+	{
+		"set_demosaic", (PyCFunction)video_device_set_demosaic_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_demosaic(method=DEMOSAIC_BILINEAR, threads=1)\n\n"
+		"Deliver raw Bayer frames (SRGGB8, SGRBG8, SGBRG8, SBGGR8) "
+		"as RGB24. 'method' is DEMOSAIC_BILINEAR (fast) or "
+		"DEMOSAIC_EDGE (gradient directed, fewer color fringes on "
+		"edges), DEMOSAIC_NONE delivers the raw mosaic. Unscaled "
+		"frames are split in bands among 'threads' threads. Scaled "
+		"frames are demosaiced by the reading thread alone, row by "
+		"row as the scaler pulls them. The demosaic is fused with "
+		"cropping, scaling and the frame statistics."
+	},
+	{
+		"set_depth", (PyCFunction)video_device_set_depth_locked,
+		METH_VARARGS,
+		"set_depth(depth=16)\n\n"
+		"Samples of high depth formats (Y10, Y12, Y16, SRGGB10...) "
+		"are delivered as little endian 16 bit integers, rows packed "
+		"without the driver's padding. RAW10 packed formats (Y10P, "
+		"SRGGB10P...) are unpacked, to Y10 or SRGGB10. With a depth "
+		"of 8, only the 8 most significant bits are kept (GREY or "
+		"SRGGB8...), e.g. for previews."
+	},
+	{
+		"negotiate_format",
+		(PyCFunction)video_device_negotiate_format_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"negotiate_format(size_x, size_y, min_fps=0, output='RGB3', "
+		"calibrate=False, apply=True) -> dict\n\n"
+		"Choose the device format delivering 'output' frames of at "
+		"least size_x by size_y at 'min_fps' for the least CPU. "
+		"Formats, sizes and frame intervals are enumerated and each "
+		"candidate is priced by its conversion: 'copy', 'yuyv', "
+		"'demosaic', 'unpack' or 'reduce' natively, 'libv4l' or "
+		"'jpeg' for formats emulated by libv4l. With 'calibrate', "
+		"the native conversions are timed on this machine first. "
+		"With 'apply', the format and frame interval are set and the "
+		"demosaic or depth the conversion needs is enabled. Returns "
+		"'fourcc', 'size', 'fps' (0 when unknown), the expected "
+		"'cost' in CPU seconds per frame and 'conversion'."
+	},
+	{
+		"set_motion_gate", (PyCFunction)video_device_set_motion_gate_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_motion_gate(threshold, heartbeat=0.0, step=8)\n\n"
+		"Deliver only frames whose luma changed since the last "
+		"delivered frame. The change is the mean absolute difference "
+		"(0 to 255) of a grid sampling one pixel out of 'step' in both "
+		"directions, compared with 'threshold'. A frame is delivered "
+		"anyway when 'heartbeat' seconds passed since the last one. "
+		"Like decimation, skipped frames are not converted and 'read' "
+		"returns None. Compressed formats are never gated. A zero "
+		"threshold disables gating."
+	},
+	{
+		"get_motion_score", (PyCFunction)video_device_get_motion_score_locked,
+		METH_NOARGS,
+		"get_motion_score() -> score\n\n"
+		"Returns the change measured on the last gated frame, to tune "
+		"the threshold, or None if gating is disabled."
+	},
+	{
+		"set_frame_stats", (PyCFunction)video_device_set_frame_stats_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"set_frame_stats(enabled=True, step=4)\n\n"
+		"Compute statistics of each delivered frame while converting "
+		"it, without reading it again. The focus score samples one "
+		"pixel out of 'step' horizontally and one row out of 'step'."
+	},
+	{
+		"get_frame_stats", (PyCFunction)video_device_get_frame_stats_locked,
+		METH_NOARGS,
+		"get_frame_stats() -> dict{'histogram', 'means', 'luma', "
+		"'focus'}\n\n"
+		"Returns the statistics of the last delivered frame: the 256 "
+		"bins luma histogram, the mean of each channel in output "
+		"order, the mean luma and the variance of the luma Laplacian "
+		"(higher when sharper), computed on every row before scaling, "
+		"even those SCALE_BILINEAR skips. Returns None "
+		"if statistics are disabled or the format is compressed."
+	},
+	{
+		"publish", (PyCFunction)video_device_publish_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"publish(slots=4, slot_size=0) -> fd\n\n"
+		"Publish every delivered frame to a shared memory ring of "
+		"'slots' frames, read in place by V4L2FrameSubscriber objects "
+		"in other processes. The default slot size is the one of a "
+		"frame with the current format, crop and scale settings. "
+		"Returns the memfd of the ring, to be passed to the "
+		"subscribers. Frames are skipped when every slot is still "
+		"referenced. publish(0) stops publishing."
+	},
+	{
+		"read_and_publish", (PyCFunction)video_device_read_and_publish_locked,
+		METH_NOARGS,
+		"read_and_publish() -> sequence\n\n"
+		"Same as 'read_and_queue', but the frame is only converted into "
+		"the shared ring. Returns its sequence number, or None if it "
+		"was skipped or not published."
+	},
+	{
+		"get_publish_stats", (PyCFunction)video_device_get_publish_stats_locked,
+		METH_NOARGS,
+		"get_publish_stats() -> dict{'sequence', 'dropped'}\n\n"
+		"Returns the last published sequence and the number of frames "
+		"that could not be published."
+	},
+	{
+		"set_flight_recorder",
+		(PyCFunction)video_device_set_flight_recorder_locked,
+		METH_VARARGS,
+		"set_flight_recorder(size)\n\n"
+		"Keep the last dequeued frames, as delivered by the driver "
+		"(e.g. MJPG), in a ring of 'size' bytes allocated once, the "
+		"oldest frames being overwritten. A size of 0 disables the "
+		"recorder."
+	},
+	{
+		"dump", (PyCFunction)video_device_dump_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"dump(path, before_s, after_s=0.0)\n\n"
+		"Write the recorded frames from 'before_s' seconds ago to "
+		"'after_s' seconds from now to a capture file at 'path', "
+		"which V4L2ReplayDevice plays back. Frames in another format "
+		"than the current one are left out. The file is written "
+		"by a background thread; frames that would overwrite those "
+		"not written yet are dropped from the recorder instead of "
+		"delaying the capture."
+	},
+	{
+		"get_recorder_stats",
+		(PyCFunction)video_device_get_recorder_stats_locked,
+		METH_NOARGS,
+		"get_recorder_stats() -> dict{'frames', 'recorded', 'dropped', "
+		"'dumping', 'dumped', 'error'}\n\n"
+		"Returns the frames held by the flight recorder, recorded and "
+		"dropped since it was enabled, whether a dump is running, the "
+		"frames written by the last dump and its errno, 0 if none."
+	},
+	{
+		"save_snapshot", (PyCFunction)video_device_save_snapshot_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"save_snapshot(path, format='jpeg', quality=90) -> "
+		"V4L2SnapshotFuture\n\n"
+		"Dequeue the next frame and write it to 'path' as 'jpeg' or "
+		"'png' from a worker thread, at full resolution, cropped if "
+		"'set_crop' was called, demosaiced and unpacked like 'read'. "
+		"MJPG frames are written as they are. The buffer is queued "
+		"back by the first read or wait after the file is written. "
+		"Returns None like 'read' if only skipped frames were "
+		"available."
+	},
+	{
+		"start_recording",
+		(PyCFunction)video_device_start_recording_locked, METH_VARARGS,
+		"start_recording(path)\n\n"
+		"Append every dequeued buffer, as delivered by the driver, "
+		"with its metadata to a capture file at 'path', which "
+		"V4L2ReplayDevice plays back. The frame data is page aligned "
+		"in the file so it can be mapped in place."
+	},
+	{
+		"stop_recording",
+		(PyCFunction)video_device_stop_recording_locked, METH_NOARGS,
+		"stop_recording() -> frames\n\n"
+		"Close the capture file and return the number of frames "
+		"written. Raises IOError if a write failed, the file then "
+		"holds the frames written before."
+	},
+	{
+		"wait", (PyCFunction)video_device_wait_locked, METH_VARARGS,
+		"wait(timeout=-1) -> bool\n\n"
+		"Wait for a filled buffer (an empty one for output devices) for "
+		"at most 'timeout' seconds, forever if negative, without "
+		"holding the GIL. Returns True if one is ready."
+	},
+	{
+		"set_thread_affinity",
+		(PyCFunction)video_device_set_thread_affinity_locked, METH_VARARGS,
+		"set_thread_affinity(cpus=None)\n\n"
+		"Pin the threads calling 'wait' and the read methods to the "
+		"given iterable of CPU numbers, which must be allowed to the "
+		"process. Each thread is pinned at its next call, so the "
+		"thread configuring the device is left alone. With None, "
+		"the threads get their own CPUs back: at once for the "
+		"calling thread, at their next call for the others."
+	},
+	{
+		"set_thread_scheduling",
+		(PyCFunction)video_device_set_thread_scheduling_locked, METH_VARARGS,
+		"set_thread_scheduling(policy=SCHED_OTHER, priority=0)\n\n"
+		"Run the threads calling 'wait' and the read methods with the "
+		"given policy (SCHED_OTHER, SCHED_FIFO or SCHED_RR) and "
+		"priority, applied and undone like set_thread_affinity, "
+		"SCHED_OTHER undoing. Real-time policies need CAP_SYS_NICE "
+		"or an RLIMIT_RTPRIO, otherwise the first call of a thread "
+		"raises OSError."
+	},
+	{
+		"set_lock_buffers", (PyCFunction)video_device_set_lock_buffers_locked,
+		METH_VARARGS,
+		"set_lock_buffers(lock=True)\n\n"
+		"Lock the buffers in memory when they are created, which also "
+		"faults them in up front. Must be called before "
+		"'create_buffers'. Limited by RLIMIT_MEMLOCK."
+	},
+	{
+		"get_timing_stats", (PyCFunction)video_device_get_timing_stats_locked,
+		METH_NOARGS,
+		"get_timing_stats() -> dict{'frames', 'latency_mean', "
+		"'latency_min', 'latency_max', 'jitter'}\n\n"
+		"Returns the delay in seconds between the end of each frame, "
+		"as timestamped by the driver, and its dequeue, with 'jitter' "
+		"its standard deviation. Returns None until a frame with a "
+		"monotonic timestamp has been dequeued."
+	},
+	{
+		"reset_timing_stats",
+		(PyCFunction)video_device_reset_timing_stats_locked, METH_NOARGS,
+		"reset_timing_stats()\n\n"
+		"Restart the timing measurements."
+	},
+	{
+		"read", (PyCFunction)video_device_read_locked, METH_NOARGS,
+		"read() -> string\n\n"
+		"Reads image data from a buffer that has been filled by the "
+		"video device. The image data is in RGB och YUV420 format as "
+		"decided by 'set_format'. The buffer is removed from the "
+		"queue. Fails if no buffer is filled. Use select.select to "
+		"check for filled buffers."
+	},
+	{
+		"read_and_queue", (PyCFunction)video_device_read_and_queue_locked,
+		METH_NOARGS,
+		"read_and_queue()\n\n"
+		"Same as 'read', but adds the buffer back to the queue so "
+		"the video device can fill it again."
+	},
+	{
+		"read_into", (PyCFunction)video_device_read_into_locked, METH_VARARGS,
+		"read_into(buffer, queue=True) -> length\n\n"
+		"Same as 'read_and_queue' (or 'read' if queue is False), but "
+		"the image data is written to the given writable buffer, "
+		"e.g. a bytearray reused for every frame. Returns the number "
+		"of bytes written."
+	},
+	{
+		NULL
+	}
+};
+
+static PyType_Slot video_device_slots[] = {
+	{Py_tp_dealloc, video_device_dealloc},
+	{Py_tp_doc, "V4L2VideoDevice(type, path)\n\nThe video device at "
+	 "the given path, opened by 'open', as an object that can capture "
+	 "images. 'type' is the buffer type, e.g. "
+	 "V4L2_BUF_TYPE_VIDEO_CAPTURE. All methods except close may raise "
+	 "IOError."},
+	{Py_tp_methods, video_device_methods},
+	{Py_tp_init, video_device_init},
+	{Py_tp_new, video_device_new},
+	{0, NULL}
+};
+
+static PyType_Spec video_device_spec = {
+	.name = "pyv4l2.V4L2VideoDevice",
+	.basicsize = sizeof(video_device),
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.slots = video_device_slots
+};
+
+static int replay_device_init(video_device *videodev,
+			      PyObject *args, PyObject *kwargs)
+{
+	int realtime = 1;
+	int loop = 0;
+	const char *path = NULL;
+	struct replay *replay = NULL;
+	static char *kwlist[] = {
+		"path",
+		"realtime",
+		"loop",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|pp", kwlist,
+					 &path, &realtime, &loop))
+		return -1;
+
+	if (videodev->replay) {
+		PyErr_SetString(PyExc_ValueError, "Already initialized");
+		return -1;
+	}
+
+	replay = calloc(1, sizeof(*replay));
+	if (!replay || !(replay->path = strdup(path))) {
+		free(replay);
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	replay->realtime = realtime;
+	replay->loop = loop;
+
+	videodev->replay = replay;
+	videodev->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	videodev->path = replay->path;
+	videodev->fd = -1;
+	videodev->buffers = NULL;
+	videodev->buffer_count = 0;
+
+	return 0;
+}
+
+static PyType_Slot replay_device_slots[] = {
+	{Py_tp_doc, "V4L2ReplayDevice(path, realtime=True, loop=False)\n\n"
+	 "A video device playing back the capture file at the given path, "
+	 "written by 'start_recording' or 'dump', with the same methods. "
+	 "Frames are served at the pace they were recorded, or as fast as "
+	 "they are read if 'realtime' is False, and never dropped. Reading "
+	 "past the last frame raises IOError (ENODATA) unless 'loop' is "
+	 "True. Controls are not supported."},
+	{Py_tp_init, replay_device_init},
+	{0, NULL}
+};
+
+static PyType_Spec replay_device_spec = {
+	.name = "pyv4l2.V4L2ReplayDevice",
+	.basicsize = sizeof(video_device),
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.slots = replay_device_slots
+};
+
+/*
+ * Memory-to-memory devices (scalers, codecs).
+ *
+ * Frames are fed to the OUTPUT queue and the processed result is read back
+ * from the CAPTURE queue. Every output buffer may be in flight at the same
+ * time, so the device works while the caller captures the next frame.
+ */
+#define M2M_SLOT_FREE	-2
+#define M2M_SLOT_BUSY	-1
+
+struct m2m_queue {
+	enum v4l2_buf_type type;
+	enum v4l2_memory memory;
+	struct buffer *buffers;
+	/* M2M_SLOT_FREE, M2M_SLOT_BUSY or the index of the lent source buffer */
+	int *slots;
+	int buffer_count;
+	int queued;
+};
+
+typedef struct {
+	PyObject_HEAD
+	int fd;
+	char *path;
+	struct m2m_queue output;
+	struct m2m_queue capture;
+	video_device *source;
+	int *source_fds;
+	int source_count;
+} m2m_device;
+
+static void m2m_queue_free(struct m2m_queue *queue)
+{
+	int i;
+
+	if (queue->buffers && queue->memory == V4L2_MEMORY_MMAP)
+		for (i = 0; i < queue->buffer_count; i++)
+			v4l2_munmap(queue->buffers[i].start,
+				    queue->buffers[i].length);
+
+	free(queue->buffers);
+	free(queue->slots);
+	queue->buffers = NULL;
+	queue->slots = NULL;
+	queue->buffer_count = 0;
+	queue->queued = 0;
+}
+
+static int m2m_queue_alloc(int fd, struct m2m_queue *queue, int count)
+{
+	int i = 0;
+	struct v4l2_requestbuffers reqbuf;
+	struct v4l2_buffer buffer;
+
+	CLEAR(reqbuf);
+	reqbuf.count = count;
+	reqbuf.type = queue->type;
+	reqbuf.memory = queue->memory;
+
+	if (my_ioctl(fd, VIDIOC_REQBUFS, &reqbuf)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+
+	if (!reqbuf.count) {
+		PyErr_Format(PyExc_IOError, "Not enough buffer memory");
+		return -1;
+	}
+
+	queue->buffers = calloc(reqbuf.count, sizeof(struct buffer));
+	queue->slots = malloc(reqbuf.count * sizeof(int));
+
+	if (!queue->buffers || !queue->slots) {
+		m2m_queue_free(queue);
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	for (i = 0; i < reqbuf.count; i++) {
+		queue->slots[i] = M2M_SLOT_FREE;
+
+		if (queue->memory != V4L2_MEMORY_MMAP)
+			continue;
+
+		CLEAR(buffer);
+		buffer.index = i;
+		buffer.type = queue->type;
+		buffer.memory = queue->memory;
+
+		if (my_ioctl(fd, VIDIOC_QUERYBUF, &buffer))
+			break;
+
+		queue->buffers[i].length = buffer.length;
+		queue->buffers[i].start = v4l2_mmap(NULL, buffer.length,
+						    PROT_READ | PROT_WRITE,
+						    MAP_SHARED, fd,
+						    buffer.m.offset);
+
+		if (queue->buffers[i].start == MAP_FAILED)
+			break;
+	}
+
+	queue->buffer_count = i;
+
+	if (i < reqbuf.count) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		m2m_queue_free(queue);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Give the source buffer backing an output buffer back to its device */
+static int m2m_device_release_slot(m2m_device *m2mdev, int index)
+{
+	int source_index = m2mdev->output.slots[index];
+	struct v4l2_buffer buffer;
+
+	m2mdev->output.slots[index] = M2M_SLOT_FREE;
+	m2mdev->output.queued--;
+
+	if (source_index < 0 || !m2mdev->source)
+		return 0;
+
+	CLEAR(buffer);
+	buffer.index = source_index;
+	buffer.type = m2mdev->source->type;
+	buffer.memory = V4L2_MEMORY_MMAP;
+
+	if (video_device_ioctl(m2mdev->source, VIDIOC_QBUF, &buffer)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Collect the output buffers the device is done with */
+static int m2m_device_reclaim(m2m_device *m2mdev)
+{
+	struct v4l2_buffer buffer;
+
+	while (m2mdev->output.queued) {
+		CLEAR(buffer);
+		buffer.type = m2mdev->output.type;
+		buffer.memory = m2mdev->output.memory;
+
+		if (my_ioctl(m2mdev->fd, VIDIOC_DQBUF, &buffer)) {
+			if (errno == EAGAIN)
+				return 0;
+
+			PyErr_SetFromErrno(PyExc_IOError);
+			return -1;
+		}
+
+		if (m2m_device_release_slot(m2mdev, buffer.index))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int m2m_device_free_slot(m2m_device *m2mdev)
+{
+	int i;
+
+	if (!m2mdev->output.buffers) {
+		PyErr_SetString(PyExc_ValueError,
+				"Buffers have not been created");
+		return -2;
+	}
+
+	if (m2m_device_reclaim(m2mdev))
+		return -2;
+
+	for (i = 0; i < m2mdev->output.buffer_count; i++)
+		if (m2mdev->output.slots[i] == M2M_SLOT_FREE)
+			return i;
+
+	return -1;
+}
+
+static int m2m_device_queue_output(m2m_device *m2mdev, int index,
+				   struct v4l2_buffer *buffer)
+{
+	buffer->index = index;
+	buffer->type = m2mdev->output.type;
+	buffer->memory = m2mdev->output.memory;
+	buffer->field = V4L2_FIELD_NONE;
+
+	if (my_ioctl(m2mdev->fd, VIDIOC_QBUF, buffer)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+
+	m2mdev->output.slots[index] = M2M_SLOT_BUSY;
+	m2mdev->output.queued++;
+
+	return 0;
+}
+
+static void m2m_device_release_source(m2m_device *m2mdev)
+{
+	int i;
+
+	for (i = 0; i < m2mdev->source_count; i++)
+		if (m2mdev->source_fds[i] >= 0)
+			close(m2mdev->source_fds[i]);
+
+	free(m2mdev->source_fds);
+	m2mdev->source_fds = NULL;
+	m2mdev->source_count = 0;
+	Py_CLEAR(m2mdev->source);
+}
+
+static void m2m_device_unmap(m2m_device *m2mdev)
+{
+	int i;
+
+	/* Lent buffers go back to the capture device */
+	for (i = 0; i < m2mdev->output.buffer_count; i++)
+		if (m2mdev->output.slots[i] != M2M_SLOT_FREE)
+			m2m_device_release_slot(m2mdev, i);
+
+	PyErr_Clear();
+	m2m_queue_free(&m2mdev->output);
+	m2m_queue_free(&m2mdev->capture);
+	m2m_device_release_source(m2mdev);
+}
+
+static PyObject *m2m_device_new(PyTypeObject *type, PyObject *args,
+				PyObject *kwargs)
+{
+	m2m_device *m2mdev = (m2m_device *)PyType_GenericNew(type, args,
+							     kwargs);
+
+	if (m2mdev)
+		m2mdev->fd = -1;
+
+	return (PyObject *)m2mdev;
+}
+
+static int m2m_device_init(m2m_device *m2mdev, PyObject *args,
+			   PyObject *kwargs)
+{
+	const char *path = NULL;
+
+	if (!PyArg_ParseTuple(args, "s", &path))
+		return -1;
+
+	/* Initialised again: the previous device is closed */
+	if (0 <= m2mdev->fd) {
+		m2m_device_unmap(m2mdev);
+		v4l2_close(m2mdev->fd);
+		m2mdev->fd = -1;
+	}
+	free(m2mdev->path);
+
+	m2mdev->path = strdup(path);
+	m2mdev->output.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	m2mdev->output.memory = V4L2_MEMORY_MMAP;
+	m2mdev->capture.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	m2mdev->capture.memory = V4L2_MEMORY_MMAP;
+
+	if (!m2mdev->path) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	return 0;
+}
+
+static PyObject *m2m_device_open(m2m_device *m2mdev)
+{
+	m2mdev->fd = v4l2_open(m2mdev->path, O_RDWR | O_NONBLOCK);
+
+	if (m2mdev->fd < 0) {
+		return PyErr_SetFromErrnoWithFilename(PyExc_IOError,
+						      m2mdev->path);
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *m2m_device_close(m2m_device *m2mdev)
+{
+	if (0 > m2mdev->fd)
+		Py_RETURN_NONE;
+
+	m2m_device_unmap(m2mdev);
+	v4l2_close(m2mdev->fd);
+	m2mdev->fd = -1;
+
+	Py_RETURN_NONE;
+}
+
+static void m2m_device_dealloc(m2m_device *m2mdev)
+{
+	PyTypeObject *type = NULL;
+
+	if (0 <= m2mdev->fd) {
+		m2m_device_unmap(m2mdev);
+		v4l2_close(m2mdev->fd);
+	}
+
+	free(m2mdev->path);
+	type = Py_TYPE(m2mdev);
+	type->tp_free(m2mdev);
+	Py_DECREF(type);
+}
+
+static PyObject *m2m_device_fileno(m2m_device *m2mdev)
+{
+	return PyLong_FromLong(m2mdev->fd);
+}
+
+static PyObject *m2m_device_get_info(m2m_device *m2mdev)
+{
+	struct v4l2_capability caps;
+
+	if (my_ioctl(m2mdev->fd, VIDIOC_QUERYCAP, &caps))
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	return Py_BuildValue("sssi", caps.driver, caps.card, caps.bus_info,
+			     caps.capabilities);
+}
+
+static int m2m_device_set_queue_format(m2m_device *m2mdev,
+				       enum v4l2_buf_type type, __u32 fourcc,
+				       int size_x, int size_y,
+				       struct v4l2_format *format)
+{
+	CLEAR(*format);
+	format->type = type;
+
+	if (my_ioctl(m2mdev->fd, VIDIOC_G_FMT, format))
+		goto error;
+
+	format->fmt.pix.pixelformat = fourcc;
+	format->fmt.pix.width = size_x;
+	format->fmt.pix.height = size_y;
+	format->fmt.pix.field = V4L2_FIELD_NONE;
+	format->fmt.pix.bytesperline = 0;
+
+	if (my_ioctl(m2mdev->fd, VIDIOC_S_FMT, format))
+		goto error;
+
+	return 0;
+
+error:
+	PyErr_SetFromErrno(PyExc_IOError);
+	return -1;
+}
+
+static PyObject *m2m_device_set_format(m2m_device *m2mdev, PyObject *args)
+{
+	int size_x = 0;
+	int size_y = 0;
+	int out_len = 0;
+	int cap_len = 0;
+	const char *out_str = NULL;
+	const char *cap_str = NULL;
+	__u32 out_fourcc = 0;
+	__u32 cap_fourcc = 0;
+	struct v4l2_format out_format;
+	struct v4l2_format cap_format;
+
+	if (!PyArg_ParseTuple(args, "s#s#ii", &out_str, &out_len,
+			      &cap_str, &cap_len, &size_x, &size_y))
+		return NULL;
+
+	if (str2fourcc(out_str, out_len, &out_fourcc) ||
+	    str2fourcc(cap_str, cap_len, &cap_fourcc))
+		return NULL;
+
+	/* The raw side is set first, encoders derive the coded size from it */
+	if (m2m_device_set_queue_format(m2mdev, m2mdev->output.type,
+					out_fourcc, size_x, size_y,
+					&out_format) ||
+	    m2m_device_set_queue_format(m2mdev, m2mdev->capture.type,
+					cap_fourcc, size_x, size_y,
+					&cap_format))
+		return NULL;
+
+	return Py_BuildValue("iiii", out_format.fmt.pix.width,
+			     out_format.fmt.pix.height,
+			     cap_format.fmt.pix.width,
+			     cap_format.fmt.pix.height);
+}
+
+static PyObject *m2m_device_create_buffers(m2m_device *m2mdev,
+					   PyObject *args)
+{
+	int buffer_count = 0;
+	int memory = V4L2_MEMORY_MMAP;
+
+	if (!PyArg_ParseTuple(args, "I|i", &buffer_count, &memory))
+		return NULL;
+
+	if (m2mdev->output.buffers) {
+		return PyErr_Format(PyExc_ValueError, "Buffers are "
+				    "already created");
+	}
+
+	if (memory != V4L2_MEMORY_MMAP && memory != V4L2_MEMORY_DMABUF) {
+		return PyErr_Format(PyExc_ValueError, "Unsupported memory "
+				    "type %d", memory);
+	}
+
+	m2mdev->output.memory = memory;
+
+	if (m2m_queue_alloc(m2mdev->fd, &m2mdev->output, buffer_count))
+		return NULL;
+
+	if (m2m_queue_alloc(m2mdev->fd, &m2mdev->capture, buffer_count)) {
+		m2m_queue_free(&m2mdev->output);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *m2m_device_start(m2m_device *m2mdev)
+{
+	int i;
+	enum v4l2_buf_type type;
+	struct v4l2_buffer buffer;
+
+	if (!m2mdev->capture.buffers) {
+		PyErr_SetString(PyExc_ValueError,
+				"Buffers have not been created");
+		return NULL;
+	}
+
+	for (i = 0; i < m2mdev->capture.buffer_count; i++) {
+		if (m2mdev->capture.slots[i] != M2M_SLOT_FREE)
+			continue;
+
+		CLEAR(buffer);
+		buffer.index = i;
+		buffer.type = m2mdev->capture.type;
+		buffer.memory = m2mdev->capture.memory;
+
+		if (my_ioctl(m2mdev->fd, VIDIOC_QBUF, &buffer))
+			return PyErr_SetFromErrno(PyExc_IOError);
+
+		m2mdev->capture.slots[i] = M2M_SLOT_BUSY;
+		m2mdev->capture.queued++;
+	}
+
+	type = m2mdev->output.type;
+	if (my_ioctl(m2mdev->fd, VIDIOC_STREAMON, &type))
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	type = m2mdev->capture.type;
+	if (my_ioctl(m2mdev->fd, VIDIOC_STREAMON, &type))
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *m2m_device_stop(m2m_device *m2mdev)
+{
+	int i;
+	enum v4l2_buf_type type;
+
+	type = m2mdev->output.type;
+	if (my_ioctl(m2mdev->fd, VIDIOC_STREAMOFF, &type))
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	type = m2mdev->capture.type;
+	if (my_ioctl(m2mdev->fd, VIDIOC_STREAMOFF, &type))
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	/* STREAMOFF hands every buffer back to userspace */
+	for (i = 0; i < m2mdev->output.buffer_count; i++)
+		if (m2mdev->output.slots[i] != M2M_SLOT_FREE &&
+		    m2m_device_release_slot(m2mdev, i))
+			return NULL;
+
+	for (i = 0; i < m2mdev->capture.buffer_count; i++)
+		m2mdev->capture.slots[i] = M2M_SLOT_FREE;
+	m2mdev->capture.queued = 0;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *m2m_device_queue(m2m_device *m2mdev, PyObject *args)
+{
+	int index = 0;
+	Py_buffer data;
+	struct v4l2_buffer buffer;
+
+	if (!PyArg_ParseTuple(args, "s*", &data))
+		return NULL;
+
+	if (m2mdev->output.memory != V4L2_MEMORY_MMAP) {
+		PyBuffer_Release(&data);
+		return PyErr_Format(PyExc_ValueError, "Output buffers are "
+				    "not memory mapped, use queue_dmabuf");
+	}
+
+	index = m2m_device_free_slot(m2mdev);
+	if (index < 0) {
+		PyBuffer_Release(&data);
+		if (index == -1)
+			Py_RETURN_FALSE;
+		return NULL;
+	}
+
+	if (data.len > m2mdev->output.buffers[index].length) {
+		PyBuffer_Release(&data);
+		return PyErr_Format(PyExc_ValueError, "Frame of %zd bytes "
+				    "does not fit in a %zu bytes buffer",
+				    data.len,
+				    m2mdev->output.buffers[index].length);
+	}
+
+	memcpy(m2mdev->output.buffers[index].start, data.buf, data.len);
+
+	CLEAR(buffer);
+	buffer.bytesused = data.len;
+	PyBuffer_Release(&data);
+
+	if (m2m_device_queue_output(m2mdev, index, &buffer))
+		return NULL;
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject *m2m_device_queue_dmabuf(m2m_device *m2mdev,
+					 PyObject *args)
+{
+	int fd = -1;
+	int index = 0;
+	unsigned int length = 0;
+	unsigned int bytesused = 0;
+	struct v4l2_buffer buffer;
+
+	if (!PyArg_ParseTuple(args, "iII", &fd, &length, &bytesused))
+		return NULL;
+
+	if (m2mdev->output.memory != V4L2_MEMORY_DMABUF) {
+		return PyErr_Format(PyExc_ValueError, "Output buffers were "
+				    "not created for DMABUF");
+	}
+
+	index = m2m_device_free_slot(m2mdev);
+	if (index == -1)
+		Py_RETURN_FALSE;
+	if (index < 0)
+		return NULL;
+
+	CLEAR(buffer);
+	buffer.m.fd = fd;
+	buffer.length = length;
+	buffer.bytesused = bytesused;
+
+	if (m2m_device_queue_output(m2mdev, index, &buffer))
+		return NULL;
+
+	Py_RETURN_TRUE;
+}
+
+static int m2m_device_set_source(m2m_device *m2mdev, video_device *source)
+{
+	int i;
+
+	if (m2mdev->source == source)
+		return 0;
+
+	for (i = 0; i < m2mdev->output.buffer_count; i++) {
+		if (m2mdev->output.slots[i] >= 0) {
+			PyErr_SetString(PyExc_ValueError, "Buffers of the "
+					"previous source are still in flight");
+			return -1;
+		}
+	}
+
+	m2m_device_release_source(m2mdev);
+
+	if (!source->buffers) {
+		PyErr_SetString(PyExc_ValueError, "Source buffers have not "
+				"been created");
+		return -1;
+	}
+
+	if (m2mdev->output.memory == V4L2_MEMORY_DMABUF) {
+		m2mdev->source_fds = malloc(source->buffer_count *
+					    sizeof(int));
+		if (!m2mdev->source_fds) {
+			PyErr_NoMemory();
+			return -1;
+		}
+
+		m2mdev->source_count = source->buffer_count;
+		for (i = 0; i < m2mdev->source_count; i++)
+			m2mdev->source_fds[i] = -1;
+	}
+
+	Py_INCREF(source);
+	m2mdev->source = source;
+
+	return 0;
+}
+
+static int m2m_device_source_fd(m2m_device *m2mdev, int index)
+{
+	struct v4l2_exportbuffer expbuf;
+
+	if (m2mdev->source_fds[index] >= 0)
+		return m2mdev->source_fds[index];
+
+	CLEAR(expbuf);
+	expbuf.type = m2mdev->source->type;
+	expbuf.index = index;
+	expbuf.flags = O_CLOEXEC | O_RDONLY;
+
+	if (video_device_ioctl(m2mdev->source, VIDIOC_EXPBUF, &expbuf)) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+
+	m2mdev->source_fds[index] = expbuf.fd;
+
+	return expbuf.fd;
+}
+
+static PyObject *m2m_device_queue_source(m2m_device *m2mdev,
+					 video_device *source)
+{
+	int fd = -1;
+	int ret = 0;
+	int index = 0;
+	struct frame frame;
+	struct v4l2_buffer srcbuf;
+	struct v4l2_buffer buffer;
+
+	/* The device gets the raw frames, unconverted */
+	if (source->crop.width || source->scaler || source->demosaic)
+		return PyErr_Format(PyExc_ValueError, "The source crops, "
+				    "scales or demosaics its frames, which "
+				    "queue_from can not do");
+
+	if (m2m_device_set_source(m2mdev, source))
+		return NULL;
+
+	index = m2m_device_free_slot(m2mdev);
+	if (index == -1)
+		Py_RETURN_FALSE;
+	if (index < 0)
+		return NULL;
+
+	/* Decimated, gated, recorded frames as for any read */
+	ret = video_device_next_frame(source, 1, &srcbuf, &frame);
+	if (ret <= 0) {
+		if (ret < 0)
+			return NULL;
+		Py_RETURN_NONE;
+	}
+
+	CLEAR(buffer);
+	buffer.bytesused = srcbuf.bytesused;
+	buffer.timestamp = srcbuf.timestamp;
+	buffer.flags = srcbuf.flags & V4L2_BUF_FLAG_TIMESTAMP_COPY;
+
+	if (m2mdev->output.memory == V4L2_MEMORY_DMABUF) {
+		/* Zero copy: the capture buffer stays dequeued until the
+		 * m2m device is done reading it */
+		fd = m2m_device_source_fd(m2mdev, srcbuf.index);
+		if (fd < 0)
+			goto requeue;
+
+		buffer.m.fd = fd;
+		buffer.length = source->buffers[srcbuf.index].length;
+
+		if (m2m_device_queue_output(m2mdev, index, &buffer))
+			goto requeue;
+
+		m2mdev->output.slots[index] = srcbuf.index;
+		Py_RETURN_TRUE;
+	}
+
+	if (srcbuf.bytesused > m2mdev->output.buffers[index].length) {
+		PyErr_Format(PyExc_ValueError, "Frame of %u bytes does not "
+			     "fit in a %zu bytes buffer", srcbuf.bytesused,
+			     m2mdev->output.buffers[index].length);
+		goto requeue;
+	}
+
+	memcpy(m2mdev->output.buffers[index].start,
+	       source->buffers[srcbuf.index].start, srcbuf.bytesused);
+
+	if (video_device_ioctl(source, VIDIOC_QBUF, &srcbuf))
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	if (m2m_device_queue_output(m2mdev, index, &buffer))
+		return NULL;
+
+	Py_RETURN_TRUE;
+
+requeue:
+	video_device_ioctl(source, VIDIOC_QBUF, &srcbuf);
+	return NULL;
+}
+
+static PyObject *m2m_device_read(m2m_device *m2mdev)
+{
+	PyObject *result = NULL;
+	struct v4l2_buffer buffer;
+
+	if (!m2mdev->capture.buffers) {
+		PyErr_SetString(PyExc_ValueError,
+				"Buffers have not been created");
+		return NULL;
+	}
+
+	if (m2m_device_reclaim(m2mdev))
+		return NULL;
+
+	CLEAR(buffer);
+	buffer.type = m2mdev->capture.type;
+	buffer.memory = m2mdev->capture.memory;
+
+	if (my_ioctl(m2mdev->fd, VIDIOC_DQBUF, &buffer))
+		return PyErr_SetFromErrno(PyExc_IOError);
+
+	result = PYSTRING_FROM_STR_SZ(m2mdev->capture.buffers[buffer.index].
+				      start, buffer.bytesused);
+
+	if (my_ioctl(m2mdev->fd, VIDIOC_QBUF, &buffer)) {
+		Py_XDECREF(result);
+		return PyErr_SetFromErrno(PyExc_IOError);
+	}
+
+	return result;
+}
+
+static PyObject *m2m_device_get_in_flight(m2m_device *m2mdev)
+{
+	if (m2m_device_reclaim(m2mdev))
+		return NULL;
+
+	return PyLong_FromLong(m2mdev->output.queued);
+}
+
+/* Both the device and the source capture device are locked */
+static PyObject *m2m_device_queue_from(m2m_device *m2mdev, PyObject *args)
+{
+	PyObject *ret = NULL;
+	video_device *source = NULL;
+
+	if (!PyArg_ParseTuple(args, "O!",
+			      module_state_of(Py_TYPE(m2mdev))->video_device_type,
+			      &source))
+		return NULL;
+
+	OBJECT_LOCK2((PyObject *)m2mdev, (PyObject *)source);
+	ret = m2m_device_queue_source(m2mdev, source);
+	OBJECT_UNLOCK2();
+	return ret;
+}
+
+LOCKED_NOARGS(m2m_device_open, m2m_device);
+LOCKED_NOARGS(m2m_device_close, m2m_device);
+LOCKED_NOARGS(m2m_device_fileno, m2m_device);
+LOCKED_NOARGS(m2m_device_get_info, m2m_device);
+LOCKED_VARARGS(m2m_device_set_format, m2m_device);
+LOCKED_VARARGS(m2m_device_create_buffers, m2m_device);
+LOCKED_NOARGS(m2m_device_start, m2m_device);
+LOCKED_NOARGS(m2m_device_stop, m2m_device);
+LOCKED_VARARGS(m2m_device_queue, m2m_device);
+LOCKED_VARARGS(m2m_device_queue_dmabuf, m2m_device);
+LOCKED_NOARGS(m2m_device_read, m2m_device);
+LOCKED_NOARGS(m2m_device_get_in_flight, m2m_device);
+
+static PyMethodDef m2m_device_methods[] = {
+	{
+		"open", (PyCFunction)m2m_device_open_locked, METH_NOARGS,
+		"open()\n\n"
+		"Open the memory-to-memory device."
+	},
+	{
+		"close", (PyCFunction)m2m_device_close_locked, METH_NOARGS,
+		"close()\n\n"
+		"Close the memory-to-memory device. Buffers borrowed from a "
+		"capture device are queued back to it."
 	},
 	{
-		"get_format", (PyCFunction)video_device_get_format,
-		METH_NOARGS,
-		"get_format() -> size_x, size_y, fourcc\n\n"
-		"Request the current video format."
+		"fileno", (PyCFunction)m2m_device_fileno_locked, METH_NOARGS,
+		"fileno() -> fd\n\n"
+		"Returns the file descriptor of the device, so the object can "
+		"be passed to select.select. The device is readable when a "
+		"processed frame is available."
 	},
 	{
-		"set_format", (PyCFunction)video_device_set_format,
-		METH_VARARGS | METH_KEYWORDS,
-		"set_format(size_x, size_y, yuv420 = 0, fourcc='MJPEG') -> "
-		"size_x, size_y\n\n"
-		"Request the video device to set image size and format. "
-		"The device may choose another size than requested and will "
-		"return its choice. "
-		"The image format will be RGB24 if yuv420 is zero (default) "
-		"or YUV420 if yuv420 is 1, if fourcc keyword is set that will "
-		"be the fourcc pixel format used."
+		"get_info", (PyCFunction)m2m_device_get_info_locked, METH_NOARGS,
+		"get_info() -> driver, card, bus_info, capabilities\n\n"
+		"Same as V4L2VideoDevice.get_info."
 	},
 	{
-		"set_fps", (PyCFunction)video_device_set_fps, METH_VARARGS,
-		"set_fps(fps) -> fps \n\n"
-		"Request the video device to set frame per seconds.The device "
-		"may choose another frame rate than requested and will return "
-		"its choice. "
+		"set_format", (PyCFunction)m2m_device_set_format_locked,
+		METH_VARARGS,
+		"set_format(output_fourcc, capture_fourcc, size_x, size_y) -> "
+		"output_x, output_y, capture_x, capture_y\n\n"
+		"Set the format of the frames fed to the device (output) and "
+		"of the processed frames (capture). The device may choose "
+		"other sizes and will return its choice."
 	},
 	{
-		"set_auto_white_balance",
-		(PyCFunction)video_device_set_auto_wb, METH_VARARGS,
-		"set_auto_white_balance(autowb) -> autowb \n\n"
-		"Request the video device to set auto white balance to value. "
-		"The device may choose another value than requested and will "
-		"return its choice. "
+		"create_buffers", (PyCFunction)m2m_device_create_buffers_locked,
+		METH_VARARGS,
+		"create_buffers(count, memory=V4L2_MEMORY_MMAP)\n\n"
+		"Create 'count' buffers on both queues, i.e. the number of "
+		"frames that can be in flight. With V4L2_MEMORY_DMABUF the "
+		"output queue imports the buffers of a capture device "
+		"instead of copying them."
 	},
 	{
-		"get_auto_white_balance",
-		(PyCFunction)video_device_get_auto_wb, METH_NOARGS,
-		"get_auto_white_balance() -> autowb \n\n"
-		"Request the video device to get auto white balance value. "
+		"start", (PyCFunction)m2m_device_start_locked, METH_NOARGS,
+		"start()\n\n" "Queue the capture buffers and start processing."
 	},
 	{
-		"set_white_balance_temperature",
-		(PyCFunction)video_device_set_wb_temperature, METH_VARARGS,
-		"set_white_balance_temperature(temp) -> temp \n\n"
-		"Request the video device to set white balance tempature to "
-		"value. The device may choose another value than requested "
-		"and will return its choice. "
+		"stop", (PyCFunction)m2m_device_stop_locked, METH_NOARGS,
+		"stop()\n\n" "Stop processing and release every buffer."
 	},
 	{
-		"get_white_balance_temperature",
-		(PyCFunction)video_device_get_wb_temperature, METH_NOARGS,
-		"get_white_balance_temperature() -> temp \n\n"
-		"Request the video device to get white balance temperature "
-		"value. "
+		"queue", (PyCFunction)m2m_device_queue_locked, METH_VARARGS,
+		"queue(data) -> bool\n\n"
+		"Copy a frame into a free output buffer and queue it. Returns "
+		"False when all output buffers are in flight."
 	},
 	{
-		"set_exposure_auto",
-		(PyCFunction)video_device_set_exposure_auto,
+		"queue_dmabuf", (PyCFunction)m2m_device_queue_dmabuf_locked,
 		METH_VARARGS,
-		"set_exposure_auto(autoexp) -> autoexp \n\n"
-		"Request the video device to set auto exposure to value. The "
-		"device may choose another value than requested and will "
-		"return its choice. "
+		"queue_dmabuf(fd, length, bytesused) -> bool\n\n"
+		"Queue a DMABUF file descriptor as the next frame. Returns "
+		"False when all output buffers are in flight."
 	},
 	{
-		"get_exposure_auto",
-		(PyCFunction)video_device_get_exposure_auto,
-		METH_NOARGS,
-		"get_exposure_auto() -> autoexp \n\n"
-		"Request the video device to get auto exposure value. "
+		"queue_from", (PyCFunction)m2m_device_queue_from,
+		METH_VARARGS,
+		"queue_from(video_device) -> bool or None\n\n"
+		"Dequeue the next frame of a streaming capture device and "
+		"queue it. With DMABUF output buffers the capture buffer is "
+		"shared with the device and given back once processed, "
+		"otherwise it is copied and requeued at once. Frames are "
+		"taken like 'read' does: decimation, motion gating, the "
+		"flight recorder and recordings apply, and None is returned "
+		"when only skipped frames were available. The device gets "
+		"the raw frames, so a source that crops, scales or "
+		"demosaics raises ValueError. Returns False, without "
+		"touching the capture device, when all output buffers are in "
+		"flight."
 	},
 	{
-		"set_exposure_absolute",
-		(PyCFunction)video_device_set_exposure_absolute,
-		METH_VARARGS,
-		"set_exposure_absolute(exptime) -> exptime \n\n"
-		"Request the video device to set exposure time to value. The "
-		"device may choose another value than requested and will "
-		"return its choice. "
+		"read", (PyCFunction)m2m_device_read_locked, METH_NOARGS,
+		"read() -> string\n\n"
+		"Read the next processed frame and give its buffer back to the "
+		"device. Fails if no frame is ready. Use select.select to "
+		"wait for processed frames."
 	},
 	{
-		"get_exposure_absolute",
-		(PyCFunction)video_device_get_exposure_absolute,
+		"get_in_flight", (PyCFunction)m2m_device_get_in_flight_locked,
 		METH_NOARGS,
-		"get_exposure_absolute() -> exptime \n\n"
-		"Request the video device to get exposure time value. "
+		"get_in_flight() -> count\n\n"
+		"Returns the number of frames queued and not processed yet."
 	},
 	{
-		"set_focus_auto", (PyCFunction)video_device_set_focus_auto,
-		METH_VARARGS,
-		"set_auto_focus_auto(autofocus) -> autofocus \n\n"
-		"Request the video device to set auto focuse on or off. The "
-		"device may choose another value than requested and will "
-		"return its choice. "
+		NULL
+	}
+};
+
+static PyType_Slot m2m_device_slots[] = {
+	{Py_tp_dealloc, m2m_device_dealloc},
+	{Py_tp_doc, "V4L2M2MDevice(path)\n\nOpens the memory-to-memory device "
+	 "(scaler, codec) at the given path. Frames are queued to the device "
+	 "and the processed frames are read back, several frames may be in "
+	 "flight at once."},
+	{Py_tp_methods, m2m_device_methods},
+	{Py_tp_init, m2m_device_init},
+	{Py_tp_new, m2m_device_new},
+	{0, NULL}
+};
+
+static PyType_Spec m2m_device_spec = {
+	.name = "pyv4l2.V4L2M2MDevice",
+	.basicsize = sizeof(m2m_device),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = m2m_device_slots
+};
+
+/*
+ * Subscribers of a shared frame ring published by a V4L2VideoDevice,
+ * usually in another process.
+ */
+typedef struct {
+	PyObject_HEAD
+	size_t size;
+	struct shm_ring_header *header;
+	uint64_t last_seq;
+	/* Geometry checked when mapping, the publisher can not change it */
+	uint32_t slot_count;
+	uint64_t slot_size;
+	uint64_t slot_stride;
+	uint64_t data_offset;
+} frame_subscriber;
+
+typedef struct {
+	PyObject_HEAD
+	frame_subscriber *subscriber;
+	struct shm_ring_slot *slot;
+	unsigned long long sequence;
+	unsigned long long length;
+	unsigned int width;
+	unsigned int height;
+	unsigned int fourcc;
+	double timestamp;
+	int exports;
+} shared_frame;
+
+/* The ring is another process's memory: its slots must fit the mapping */
+static int frame_subscriber_check(const struct shm_ring_header *header,
+				  size_t size)
+{
+	if (size < sizeof(*header) || header->magic != SHM_RING_MAGIC ||
+	    header->version != SHM_RING_VERSION)
+		return -1;
+
+	if (!header->slot_count || header->data_offset < sizeof(*header) ||
+	    header->data_offset > size ||
+	    header->slot_stride < SHM_SLOT_HEADER ||
+	    (header->data_offset | header->slot_stride) % 8 ||
+	    header->slot_size > header->slot_stride - SHM_SLOT_HEADER)
+		return -1;
+
+	/* Divided, the product could wrap */
+	if (header->slot_stride > (size - header->data_offset) /
+	    header->slot_count)
+		return -1;
+
+	return 0;
+}
+
+static struct shm_ring_slot *frame_subscriber_slot(frame_subscriber *sub,
+						   uint64_t seq)
+{
+	return (struct shm_ring_slot *)((unsigned char *)sub->header +
+					sub->data_offset +
+					(seq % sub->slot_count) *
+					sub->slot_stride);
+}
+
+static int frame_subscriber_init(frame_subscriber *sub, PyObject *args,
+				 PyObject *kwargs)
+{
+	int fd = -1;
+	int own_fd = 0;
+	const char *path = NULL;
+	struct stat st;
+	struct shm_ring_header *header = NULL;
+
+	/* Shared frames point into the current mapping */
+	if (sub->header) {
+		PyErr_SetString(PyExc_ValueError, "Ring already opened");
+		return -1;
+	}
+
+	if (!PyArg_ParseTuple(args, "i", &fd)) {
+		PyErr_Clear();
+		if (!PyArg_ParseTuple(args, "s", &path))
+			return -1;
+
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+			return -1;
+		}
+		own_fd = 1;
+	}
+
+	if (fstat(fd, &st))
+		goto error;
+
+	header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      fd, 0);
+	if (header == MAP_FAILED)
+		goto error;
+
+	if (own_fd)
+		close(fd);
+
+	if (frame_subscriber_check(header, st.st_size)) {
+		munmap(header, st.st_size);
+		PyErr_SetString(PyExc_ValueError, "Not a pyv4l2 frame ring");
+		return -1;
+	}
+
+	sub->size = st.st_size;
+	sub->header = header;
+	sub->last_seq = 0;
+	sub->slot_count = header->slot_count;
+	sub->slot_size = header->slot_size;
+	sub->slot_stride = header->slot_stride;
+	sub->data_offset = header->data_offset;
+
+	return 0;
+
+error:
+	PyErr_SetFromErrno(PyExc_IOError);
+	if (own_fd)
+		close(fd);
+	return -1;
+}
+
+static void frame_subscriber_dealloc(frame_subscriber *sub)
+{
+	PyTypeObject *type = Py_TYPE(sub);
+
+	if (sub->header)
+		munmap(sub->header, sub->size);
+
+	type->tp_free(sub);
+	Py_DECREF(type);
+}
+
+static int shm_slot_acquire(struct shm_ring_slot *slot, uint64_t seq)
+{
+	uint32_t count = __atomic_load_n(&slot->refcount, __ATOMIC_RELAXED);
+
+	do {
+		if (count & SHM_SLOT_WRITER)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&slot->refcount, &count,
+					      count + 1, 1, __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED));
+
+	/* The slot may have been reused before the reference was taken */
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+		__atomic_sub_fetch(&slot->refcount, 1, __ATOMIC_RELEASE);
+		return -1;
+	}
+
+	return 0;
+}
+
+static PyObject *frame_subscriber_read(frame_subscriber *sub,
+				       PyObject *args, PyObject *keywds)
+{
+	int latest = 1;
+	uint64_t seq = 0;
+	uint64_t first = 0;
+	uint64_t last = 0;
+	shared_frame *frame = NULL;
+	struct shm_ring_slot *slot = NULL;
+	struct shm_ring_header *header = sub->header;
+	static char *kwlist[] = {
+		"latest",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|i", kwlist,
+					 &latest))
+		return NULL;
+
+	last = __atomic_load_n(&header->write_seq, __ATOMIC_ACQUIRE);
+	first = sub->last_seq + 1;
+	if (last >= sub->slot_count && first <= last - sub->slot_count)
+		first = last - sub->slot_count + 1;
+
+	/* Newest first when only the latest frame matters, oldest first
+	 * otherwise. Slots being rewritten are passed over. */
+	for (seq = latest ? last : first; seq >= first && seq <= last;
+	     seq = latest ? seq - 1 : seq + 1) {
+		slot = frame_subscriber_slot(sub, seq);
+		if (!shm_slot_acquire(slot, seq))
+			break;
+		slot = NULL;
+	}
+
+	if (!slot)
+		Py_RETURN_NONE;
+
+	frame = PyObject_New(shared_frame,
+			     module_state_of(Py_TYPE(sub))->shared_frame_type);
+	if (!frame) {
+		__atomic_sub_fetch(&slot->refcount, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	Py_INCREF(sub);
+	frame->subscriber = sub;
+	frame->slot = slot;
+	frame->sequence = seq;
+	frame->length = slot->length;
+	if (frame->length > sub->slot_size)
+		frame->length = sub->slot_size;
+	frame->width = slot->width;
+	frame->height = slot->height;
+	frame->fourcc = slot->fourcc;
+	frame->timestamp = slot->timestamp;
+	frame->exports = 0;
+	sub->last_seq = seq;
+
+	return (PyObject *)frame;
+}
+
+static PyObject *frame_subscriber_wait(frame_subscriber *sub,
+				       PyObject *args)
+{
+	long ret = 0;
+	double timeout = -1;
+	uint32_t notify = 0;
+	struct timespec ts;
+	struct shm_ring_header *header = sub->header;
+
+	if (!PyArg_ParseTuple(args, "|d", &timeout))
+		return NULL;
+
+	notify = __atomic_load_n(&header->notify, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&header->write_seq, __ATOMIC_ACQUIRE) >
+	    sub->last_seq)
+		Py_RETURN_TRUE;
+
+	ts.tv_sec = (time_t)timeout;
+	ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1000000000);
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = syscall(SYS_futex, &header->notify, FUTEX_WAIT, notify,
+		      timeout < 0 ? NULL : &ts, NULL, 0);
+	Py_END_ALLOW_THREADS
+
+	if (ret && errno == EINTR && PyErr_CheckSignals())
+		return NULL;
+
+	return PyBool_FromLong(__atomic_load_n(&header->write_seq,
+					       __ATOMIC_ACQUIRE) >
+			       sub->last_seq);
+}
+
+static PyObject *frame_subscriber_get_info(frame_subscriber *sub)
+{
+	return Py_BuildValue("{s:I, s:K, s:K}",
+			     "slots", sub->slot_count,
+			     "slot_size", (unsigned long long)sub->slot_size,
+			     "sequence",
+			     (unsigned long long)__atomic_load_n(
+				     &sub->header->write_seq,
+				     __ATOMIC_ACQUIRE));
+}
+
+LOCKED_KEYWORDS(frame_subscriber_read, frame_subscriber);
+LOCKED_VARARGS(frame_subscriber_wait, frame_subscriber);
+LOCKED_NOARGS(frame_subscriber_get_info, frame_subscriber);
+
+static PyMethodDef frame_subscriber_methods[] = {
+	{
+		"read", (PyCFunction)frame_subscriber_read_locked,
+		METH_VARARGS | METH_KEYWORDS,
+		"read(latest=True) -> V4L2SharedFrame\n\n"
+		"Returns the newest frame not read yet, or with latest=False "
+		"the oldest one still in the ring. Returns None when no new "
+		"frame is available. The frame is read in place, its slot is "
+		"not reused until the frame is released."
 	},
 	{
-		"get_focus_auto", (PyCFunction)video_device_get_focus_auto,
+		"wait", (PyCFunction)frame_subscriber_wait_locked, METH_VARARGS,
+		"wait(timeout=-1) -> bool\n\n"
+		"Wait for a frame newer than the last one read, for at most "
+		"'timeout' seconds (forever if negative). Returns True if "
+		"one is available."
+	},
+	{
+		"get_info", (PyCFunction)frame_subscriber_get_info_locked,
 		METH_NOARGS,
-		"get_focus_auto() -> autofocus \n\n"
-		"Request the video device to get auto focus value. "
+		"get_info() -> dict{'slots', 'slot_size', 'sequence'}\n\n"
+		"Returns the ring geometry and the last published sequence."
 	},
 	{
-		"get_framesizes", (PyCFunction)video_device_get_framesizes,
-		METH_VARARGS,
-		"get_framesizes() -> framesizes \n\n"
-		"Request the framesizes suported by the device. "
+		NULL
+	}
+};
+
+static PyType_Slot frame_subscriber_slots[] = {
+	{Py_tp_dealloc, frame_subscriber_dealloc},
+	{Py_tp_doc, "frame_subscriber(fd or path)\n\nMaps the shared frame "
+	 "ring returned by V4L2VideoDevice.publish, given its file descriptor "
+	 "(inherited or received over a socket) or a path to it, e.g. "
+	 "/proc/<pid>/fd/<fd>."},
+	{Py_tp_methods, frame_subscriber_methods},
+	{Py_tp_init, frame_subscriber_init},
+	{Py_tp_new, PyType_GenericNew},
+	{0, NULL}
+};
+
+static PyType_Spec frame_subscriber_spec = {
+	.name = "pyv4l2.V4L2FrameSubscriber",
+	.basicsize = sizeof(frame_subscriber),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = frame_subscriber_slots
+};
+
+static void shared_frame_release_slot(shared_frame *frame)
+{
+	if (!frame->slot)
+		return;
+
+	__atomic_sub_fetch(&frame->slot->refcount, 1, __ATOMIC_RELEASE);
+	frame->slot = NULL;
+}
+
+static PyObject *shared_frame_release(shared_frame *frame)
+{
+	if (frame->exports)
+		return PyErr_Format(PyExc_BufferError, "Frame data is still "
+				    "referenced");
+
+	shared_frame_release_slot(frame);
+	Py_RETURN_NONE;
+}
+
+static void shared_frame_dealloc(shared_frame *frame)
+{
+	PyTypeObject *type = Py_TYPE(frame);
+
+	shared_frame_release_slot(frame);
+	Py_XDECREF(frame->subscriber);
+	PyObject_Del(frame);
+	Py_DECREF(type);
+}
+
+static int shared_frame_getbuffer(shared_frame *frame, Py_buffer *view,
+				  int flags)
+{
+	int ret = -1;
+
+	OBJECT_LOCK((PyObject *)frame);
+
+	if (!frame->slot) {
+		PyErr_SetString(PyExc_BufferError, "Frame was released");
+		view->obj = NULL;
+	} else if (!PyBuffer_FillInfo(view, (PyObject *)frame,
+				      (unsigned char *)frame->slot +
+				      SHM_SLOT_HEADER, frame->length, 1,
+				      flags)) {
+		frame->exports++;
+		ret = 0;
+	}
+
+	OBJECT_UNLOCK();
+	return ret;
+}
+
+static void shared_frame_releasebuffer(shared_frame *frame, Py_buffer *view)
+{
+	OBJECT_LOCK((PyObject *)frame);
+	frame->exports--;
+	OBJECT_UNLOCK();
+}
+
+static PyMemberDef shared_frame_members[] = {
+	{"sequence", T_ULONGLONG, offsetof(shared_frame, sequence), READONLY,
+	 "Sequence number of the frame in the ring"},
+	{"timestamp", T_DOUBLE, offsetof(shared_frame, timestamp), READONLY,
+	 "Capture timestamp of the frame, in seconds"},
+	{"width", T_UINT, offsetof(shared_frame, width), READONLY,
+	 "Width of the image, 0 for compressed frames"},
+	{"height", T_UINT, offsetof(shared_frame, height), READONLY,
+	 "Height of the image, 0 for compressed frames"},
+	{"fourcc", T_UINT, offsetof(shared_frame, fourcc), READONLY,
+	 "Pixel format of the image"},
+	{NULL}
+};
+
+LOCKED_NOARGS(shared_frame_release, shared_frame);
+
+static PyMethodDef shared_frame_methods[] = {
+	{
+		"release", (PyCFunction)shared_frame_release_locked, METH_NOARGS,
+		"release()\n\n"
+		"Let the publisher reuse the slot of the frame. Done when the "
+		"frame is deleted otherwise. Fails if views of the data, e.g. "
+		"memoryviews, are still alive."
+	},
+	{
+		NULL
+	}
+};
+
+/* Only created by V4L2FrameSubscriber.read, hence no tp_new */
+static PyType_Slot shared_frame_slots[] = {
+	{Py_tp_dealloc, shared_frame_dealloc},
+	{Py_bf_getbuffer, shared_frame_getbuffer},
+	{Py_bf_releasebuffer, shared_frame_releasebuffer},
+	{Py_tp_doc, "Frame of a shared ring, read in place. It supports the "
+	 "buffer protocol, e.g. memoryview(frame) or "
+	 "numpy.frombuffer(frame)."},
+	{Py_tp_methods, shared_frame_methods},
+	{Py_tp_members, shared_frame_members},
+	{0, NULL}
+};
+
+static PyType_Spec shared_frame_spec = {
+	.name = "pyv4l2.V4L2SharedFrame",
+	.basicsize = sizeof(shared_frame),
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+#else
+	.flags = Py_TPFLAGS_DEFAULT,
+#endif
+	.slots = shared_frame_slots
+};
+
+static void snapshot_future_dealloc(snapshot_future *future)
+{
+	PyTypeObject *type = Py_TYPE(future);
+
+	snapshot_result_unref(future->result);
+	Py_XDECREF(future->path);
+	PyObject_Del(future);
+	Py_DECREF(type);
+}
+
+static int snapshot_future_is_done(snapshot_future *future)
+{
+	return __atomic_load_n(&future->result->done, __ATOMIC_ACQUIRE);
+}
+
+static PyObject *snapshot_future_done(snapshot_future *future)
+{
+	return PyBool_FromLong(snapshot_future_is_done(future));
+}
+
+static PyObject *snapshot_future_fileno(snapshot_future *future)
+{
+	return PyLong_FromLong(future->result->event);
+}
+
+static PyObject *snapshot_future_result(snapshot_future *future,
+					PyObject *args)
+{
+	int ret = 0;
+	double timeout = -1;
+	struct pollfd pfd;
+	struct snapshot_result *result = future->result;
+
+	if (!PyArg_ParseTuple(args, "|d", &timeout))
+		return NULL;
+
+	pfd.fd = result->event;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	while (!snapshot_future_is_done(future)) {
+		Py_BEGIN_ALLOW_THREADS
+		ret = poll(&pfd, 1, timeout < 0 ? -1 : (int)(timeout * 1000));
+		Py_END_ALLOW_THREADS
+
+		if (ret < 0 && errno == EINTR) {
+			if (PyErr_CheckSignals())
+				return NULL;
+			continue;
+		}
+		if (ret < 0)
+			return PyErr_SetFromErrno(PyExc_IOError);
+		if (!ret && !snapshot_future_is_done(future))
+			return PyErr_Format(PyExc_TimeoutError, "Snapshot "
+					    "not written yet");
+	}
+
+	if (result->message[0])
+		return PyErr_Format(PyExc_IOError, "%s", result->message);
+
+	if (result->error) {
+		errno = result->error;
+		return PyErr_SetFromErrnoWithFilenameObject(PyExc_IOError,
+							    future->path);
+	}
+
+	Py_INCREF(future->path);
+	return future->path;
+}
+
+LOCKED_NOARGS(snapshot_future_done, snapshot_future);
+LOCKED_NOARGS(snapshot_future_fileno, snapshot_future);
+LOCKED_VARARGS(snapshot_future_result, snapshot_future);
+
+static PyMethodDef snapshot_future_methods[] = {
+	{
+		"done", (PyCFunction)snapshot_future_done_locked, METH_NOARGS,
+		"done() -> bool\n\n"
+		"Returns True once the snapshot is written or failed."
 	},
 	{
-		"get_frameintervals",
-		(PyCFunction)video_device_get_frameintervals,
+		"result", (PyCFunction)snapshot_future_result_locked,
 		METH_VARARGS,
-		"get_frameintervals() -> frameintervals \n\n"
-		"Request the frameintervals suported by the device. "
-	},
-	{
-		"start", (PyCFunction)video_device_start, METH_NOARGS,
-		"start()\n\n" "Start video capture."
+		"result(timeout=-1) -> path\n\n"
+		"Wait at most 'timeout' seconds, forever if negative, without "
+		"holding the GIL, for the snapshot to be written and return "
+		"its path. Raises IOError if it failed and TimeoutError if it "
+		"is not written yet."
 	},
 	{
-		"stop", (PyCFunction)video_device_stop, METH_NOARGS,
-		"stop()\n\n" "Stop video capture."
+		"fileno", (PyCFunction)snapshot_future_fileno_locked,
+		METH_NOARGS,
+		"fileno() -> fd\n\n"
+		"Returns a file descriptor readable once the snapshot is done, "
+		"e.g. for select.select or a GUI main loop."
 	},
 	{
-		"create_buffers", (PyCFunction)video_device_create_buffers,
-		METH_VARARGS,
-		"create_buffers(count)\n\n"
-		"Create buffers used for capturing image data. Can only be "
-		"called once for each video device object."
-	},
+		NULL
+	}
+};
+
+/* Only created by V4L2VideoDevice.save_snapshot, hence no tp_new */
+static PyType_Slot snapshot_future_slots[] = {
+	{Py_tp_dealloc, snapshot_future_dealloc},
+	{Py_tp_doc, "Pending snapshot, written by a worker thread of the "
+	 "device."},
+	{Py_tp_methods, snapshot_future_methods},
+	{0, NULL}
+};
+
+static PyType_Spec snapshot_future_spec = {
+	.name = "pyv4l2.V4L2SnapshotFuture",
+	.basicsize = sizeof(snapshot_future),
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+	.flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+#else
+	.flags = Py_TPFLAGS_DEFAULT,
+#endif
+	.slots = snapshot_future_slots
+};
+
+/*
+ * Device discovery and hotplug
+ *
+ * Devices are described from sysfs and the udev database, without opening
+ * their node: only nodes udev knows nothing about are queried. Hotplug
+ * events are read from the uevent netlink socket, either as broadcast by
+ * udev once the node is ready, or straight from the kernel.
+ */
+#define SYSFS_V4L		"/sys/class/video4linux"
+#define UDEV_DATA		"/run/udev/data"
+#define UDEV_MONITOR_MAGIC	0xfeedcafe
+#define UEVENT_GROUP_KERNEL	1
+#define UEVENT_GROUP_UDEV	2
+
+/* Header of the messages udev broadcasts */
+struct udev_monitor_header {
+	char prefix[8];
+	unsigned int magic;
+	unsigned int header_size;
+	unsigned int properties_off;
+	unsigned int properties_len;
+	unsigned int filter_subsystem_hash;
+	unsigned int filter_devtype_hash;
+	unsigned int filter_tag_bloom_hi;
+	unsigned int filter_tag_bloom_lo;
+};
+
+/* First line of a sysfs attribute, -1 when it does not exist */
+static int sysfs_read(const char *dir, const char *attr, char *value,
+		      size_t size)
+{
+	int fd = -1;
+	ssize_t len = 0;
+	char path[PATH_MAX + 16];
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, attr) >=
+	    (int)sizeof(path))
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, value, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+
+	value[len] = '\0';
+	value[strcspn(value, "\n")] = '\0';
+	return 0;
+}
+
+/* Property of a character device in the udev database */
+static int udev_property(unsigned int major, unsigned int minor,
+			 const char *key, char *value, size_t size)
+{
+	FILE *file = NULL;
+	char line[512];
+	char path[PATH_MAX];
+	size_t key_len = strlen(key);
+	int ret = -1;
+
+	snprintf(path, sizeof(path), UDEV_DATA "/c%u:%u", major, minor);
+	if (0 == (file = fopen(path, "re")))
+		return -1;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (strncmp(line, "E:", 2) || strncmp(line + 2, key, key_len) ||
+		    line[2 + key_len] != '=')
+			continue;
+
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(value, size, "%s", line + 3 + key_len);
+		ret = 0;
+		break;
+	}
+
+	fclose(file);
+	return ret;
+}
+
+static PyObject *string_or_none(int missing, const char *value)
+{
+	if (missing)
+		Py_RETURN_NONE;
+
+	return PyUnicode_DecodeFSDefault(value);
+}
+
+/* Add 'key' to the dict, stealing the reference to 'value' */
+static int dict_set_steal(PyObject *dict, const char *key, PyObject *value)
+{
+	int ret = -1;
+
+	if (value)
+		ret = PyDict_SetItemString(dict, key, value);
+
+	Py_XDECREF(value);
+	return ret;
+}
+
+/*
+ * USB device of an interface, and the controller of its bus: for
+ * .../0000:00:14.0/usb1/1-1/1-1:1.0, .../usb1/1-1 and 0000:00:14.0
+ */
+static int usb_device_dirs(const char *interface, char *usb, char *controller)
+{
+	char *end = NULL;
+	char hub[PATH_MAX];
+
+	snprintf(usb, PATH_MAX, "%s", interface);
+	end = strrchr(usb, '/');
+	if (!end || !strchr(end, ':'))
+		return -1;
+	*end = '\0';
+
+	/* Root hubs are named usbN */
+	snprintf(hub, sizeof(hub), "%s", usb);
+	while ((end = strrchr(hub, '/')) && strncmp(end + 1, "usb", 3))
+		*end = '\0';
+	if (!end)
+		return -1;
+
+	*end = '\0';
+	end = strrchr(hub, '/');
+	snprintf(controller, PATH_MAX, "%s", end ? end + 1 : hub);
+	return 0;
+}
+
+/* Bus of the device as V4L2 drivers report it, plus USB identifiers */
+static int device_bus_info(PyObject *dict, const char *device)
+{
+	ssize_t len = 0;
+	int no_serial = 1;
+	int no_ids = 1;
+	char link[PATH_MAX + 16];
+	char subsystem[PATH_MAX];
+	char usb[PATH_MAX];
+	char controller[PATH_MAX];
+	char devpath[64];
+	char bus_info[2 * PATH_MAX];
+	char serial[256];
+	char vendor[16];
+	char product[16];
+
+	snprintf(link, sizeof(link), "%s/subsystem", device);
+	len = readlink(link, subsystem, sizeof(subsystem) - 1);
+	subsystem[len < 0 ? 0 : len] = '\0';
+
+	if (strstr(subsystem, "/usb") &&
+	    !usb_device_dirs(device, usb, controller) &&
+	    !sysfs_read(usb, "devpath", devpath, sizeof(devpath))) {
+		snprintf(bus_info, sizeof(bus_info), "usb-%s-%s", controller,
+			 devpath);
+		no_serial = sysfs_read(usb, "serial", serial, sizeof(serial));
+		no_ids = sysfs_read(usb, "idVendor", vendor, sizeof(vendor)) ||
+			sysfs_read(usb, "idProduct", product, sizeof(product));
+	} else if (strstr(subsystem, "/pci")) {
+		snprintf(bus_info, sizeof(bus_info), "PCI:%s",
+			 strrchr(device, '/') + 1);
+	} else {
+		snprintf(bus_info, sizeof(bus_info), "platform:%s",
+			 strrchr(device, '/') + 1);
+	}
+
+	if (dict_set_steal(dict, "bus_info", string_or_none(0, bus_info)) ||
+	    dict_set_steal(dict, "serial", string_or_none(no_serial, serial)) ||
+	    dict_set_steal(dict, "vendor_id", string_or_none(no_ids, vendor)) ||
+	    dict_set_steal(dict, "product_id", string_or_none(no_ids, product)))
+		return -1;
+
+	return 0;
+}
+
+/* Capabilities udev found, or those of the node itself as a last resort */
+static PyObject *device_capabilities(unsigned int major, unsigned int minor,
+				     const char *node, int *capture)
+{
+	int fd = -1;
+	char *token = NULL;
+	char *save = NULL;
+	char caps[256];
+	PyObject *list = NULL;
+	PyObject *item = NULL;
+	struct v4l2_capability cap;
+
+	*capture = 0;
+
+	if (!udev_property(major, minor, "ID_V4L_CAPABILITIES", caps,
+			   sizeof(caps))) {
+		if (0 == (list = PyList_New(0)))
+			return NULL;
+
+		for (token = strtok_r(caps, ":", &save); token;
+		     token = strtok_r(NULL, ":", &save)) {
+			*capture |= !strcmp(token, "capture");
+			item = PyUnicode_FromString(token);
+			if (!item || PyList_Append(list, item)) {
+				Py_XDECREF(item);
+				Py_DECREF(list);
+				return NULL;
+			}
+			Py_DECREF(item);
+		}
+
+		return list;
+	}
+
+	fd = open(node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		Py_RETURN_NONE;
+
+	CLEAR(cap);
+	if (!ioctl(fd, VIDIOC_QUERYCAP, &cap)) {
+		if (cap.capabilities & V4L2_CAP_DEVICE_CAPS)
+			cap.capabilities = cap.device_caps;
+		*capture = !!(cap.capabilities & (V4L2_CAP_VIDEO_CAPTURE |
+						  V4L2_CAP_VIDEO_CAPTURE_MPLANE));
+	}
+	close(fd);
+
+	Py_RETURN_NONE;
+}
+
+/* Description of the device 'name' (e.g. video0), None when it is gone */
+static PyObject *device_info(const char *name)
+{
+	int capture = 0;
+	unsigned int major = 0;
+	unsigned int minor = 0;
+	char dir[PATH_MAX];
+	char node[PATH_MAX];
+	char link[PATH_MAX + 16];
+	char value[256];
+	char device[PATH_MAX];
+	PyObject *dict = NULL;
+
+	snprintf(dir, sizeof(dir), SYSFS_V4L "/%s", name);
+	if (sysfs_read(dir, "dev", value, sizeof(value)) ||
+	    sscanf(value, "%u:%u", &major, &minor) != 2)
+		Py_RETURN_NONE;
+
+	snprintf(node, sizeof(node), "/dev/%s", name);
+	if (0 == (dict = PyDict_New()))
+		return NULL;
+
+	if (dict_set_steal(dict, "path", PyUnicode_DecodeFSDefault(node)))
+		goto error;
+
+	if (dict_set_steal(dict, "name", string_or_none(
+				   sysfs_read(dir, "name", value,
+					      sizeof(value)), value)) ||
+	    dict_set_steal(dict, "index", PyLong_FromLong(
+				   sysfs_read(dir, "index", value,
+					      sizeof(value)) ? 0 :
+				   atoi(value))))
+		goto error;
+
+	if (dict_set_steal(dict, "capabilities",
+			   device_capabilities(major, minor, node, &capture)) ||
+	    dict_set_steal(dict, "capture", PyBool_FromLong(capture)))
+		goto error;
+
+	snprintf(link, sizeof(link), "%s/device", dir);
+	if (!realpath(link, device)) {
+		if (dict_set_steal(dict, "sysfs", string_or_none(1, NULL)) ||
+		    dict_set_steal(dict, "bus_info", string_or_none(1, NULL)) ||
+		    dict_set_steal(dict, "serial", string_or_none(1, NULL)) ||
+		    dict_set_steal(dict, "vendor_id", string_or_none(1, NULL)) ||
+		    dict_set_steal(dict, "product_id", string_or_none(1, NULL)))
+			goto error;
+		return dict;
+	}
+
+	if (dict_set_steal(dict, "sysfs", PyUnicode_DecodeFSDefault(device)) ||
+	    device_bus_info(dict, device))
+		goto error;
+
+	/* udev knows the serial of more than USB devices */
+	if (!udev_property(major, minor, "ID_SERIAL_SHORT", value,
+			   sizeof(value)) &&
+	    dict_set_steal(dict, "serial", PyUnicode_DecodeFSDefault(value)))
+		goto error;
+
+	return dict;
+
+error:
+	Py_DECREF(dict);
+	return NULL;
+}
+
+static int video_node_filter(const struct dirent *entry)
+{
+	return !strncmp(entry->d_name, "video", 5);
+}
+
+static PyObject *list_devices(PyObject *module, PyObject *args,
+			      PyObject *keywds)
+{
+	int i;
+	int count = 0;
+	int capture_only = 1;
+	struct dirent **entries = NULL;
+	PyObject *list = NULL;
+	PyObject *info = NULL;
+	static char *kwlist[] = {
+		"capture_only",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|p", kwlist,
+					 &capture_only))
+		return NULL;
+
+	if (0 == (list = PyList_New(0)))
+		return NULL;
+
+	count = scandir(SYSFS_V4L, &entries, video_node_filter, versionsort);
+	if (count < 0)
+		return list;
+
+	for (i = 0; i < count && list; i++) {
+		info = device_info(entries[i]->d_name);
+		if (!info) {
+			Py_CLEAR(list);
+			continue;
+		}
+
+		if (info != Py_None &&
+		    (!capture_only ||
+		     PyDict_GetItemString(info, "capture") == Py_True) &&
+		    PyList_Append(list, info))
+			Py_CLEAR(list);
+
+		Py_DECREF(info);
+	}
+
+	for (i = 0; i < count; i++)
+		free(entries[i]);
+	free(entries);
+
+	return list;
+}
+
+typedef struct {
+	PyObject_HEAD
+	int fd;
+	int udev;
+} hotplug_monitor;
+
+static PyObject *hotplug_monitor_new(PyTypeObject *type, PyObject *args,
+				     PyObject *keywds)
+{
+	hotplug_monitor *monitor = NULL;
+
+	monitor = (hotplug_monitor *)PyType_GenericNew(type, args, keywds);
+	if (monitor)
+		monitor->fd = -1;
+
+	return (PyObject *)monitor;
+}
+
+static int hotplug_monitor_init(hotplug_monitor *monitor, PyObject *args,
+				PyObject *keywds)
+{
+	int udev = 1;
+	struct sockaddr_nl addr;
+	static char *kwlist[] = {
+		"udev",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, keywds, "|p", kwlist, &udev))
+		return -1;
+
+	if (monitor->fd >= 0)
+		close(monitor->fd);
+	monitor->fd = -1;
+
+	monitor->udev = udev;
+	monitor->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK |
+			     SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (monitor->fd < 0) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = udev ? UEVENT_GROUP_UDEV : UEVENT_GROUP_KERNEL;
+
+	if (bind(monitor->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		PyErr_SetFromErrno(PyExc_IOError);
+		close(monitor->fd);
+		monitor->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void hotplug_monitor_dealloc(hotplug_monitor *monitor)
+{
+	PyTypeObject *type = Py_TYPE(monitor);
+
+	if (monitor->fd >= 0)
+		close(monitor->fd);
+
+	type->tp_free(monitor);
+	Py_DECREF(type);
+}
+
+static PyObject *hotplug_monitor_fileno(hotplug_monitor *monitor)
+{
+	return PyLong_FromLong(monitor->fd);
+}
+
+static PyObject *hotplug_monitor_close(hotplug_monitor *monitor)
+{
+	if (monitor->fd >= 0)
+		close(monitor->fd);
+	monitor->fd = -1;
+
+	Py_RETURN_NONE;
+}
+
+/* Properties of a uevent message, NULL if it is not one */
+static const char *hotplug_properties(hotplug_monitor *monitor, char *msg,
+				      ssize_t len, ssize_t *props_len)
+{
+	struct udev_monitor_header *header = (void *)msg;
+	const char *props = NULL;
+
+	if (!monitor->udev) {
+		/* "action@devpath" then the properties */
+		props = memchr(msg, '\0', len);
+		if (!props || !strchr(msg, '@'))
+			return NULL;
+		props++;
+		*props_len = msg + len - props;
+		return props;
+	}
+
+	if ((size_t)len < sizeof(*header) ||
+	    memcmp(header->prefix, "libudev", 8) ||
+	    ntohl(header->magic) != UDEV_MONITOR_MAGIC ||
+	    header->properties_off > (size_t)len ||
+	    header->properties_len > (size_t)len - header->properties_off)
+		return NULL;
+
+	*props_len = header->properties_len;
+	return msg + header->properties_off;
+}
+
+static PyObject *hotplug_monitor_read(hotplug_monitor *monitor)
+{
+	ssize_t len = 0;
+	ssize_t props_len = 0;
+	const char *prop = NULL;
+	const char *props = NULL;
+	const char *action = NULL;
+	const char *devname = NULL;
+	const char *subsystem = NULL;
+	char node[PATH_MAX];
+	char msg[8192];
+	PyObject *event = NULL;
+	struct sockaddr_nl addr;
+	struct iovec iov = {msg, sizeof(msg) - 1};
+	struct msghdr hdr = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof(addr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	/* Skip the events of other subsystems until none is left */
+	for (;;) {
+		len = recvmsg(monitor->fd, &hdr, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			Py_RETURN_NONE;
+		if (len < 0)
+			return PyErr_SetFromErrno(PyExc_IOError);
+
+		/* Only the kernel sends to the kernel group, udev has a pid */
+		if (!!addr.nl_pid != monitor->udev)
+			continue;
+
+		/* The end of the properties was dropped */
+		if (hdr.msg_flags & MSG_TRUNC)
+			continue;
+
+		msg[len] = '\0';
+		props = hotplug_properties(monitor, msg, len, &props_len);
+		if (!props)
+			continue;
+
+		action = devname = subsystem = NULL;
+		for (prop = props; prop < props + props_len;
+		     prop += strlen(prop) + 1) {
+			if (!strncmp(prop, "ACTION=", 7))
+				action = prop + 7;
+			else if (!strncmp(prop, "DEVNAME=", 8))
+				devname = prop + 8;
+			else if (!strncmp(prop, "SUBSYSTEM=", 10))
+				subsystem = prop + 10;
+		}
+
+		if (action && devname && subsystem &&
+		    !strcmp(subsystem, "video4linux"))
+			break;
+	}
+
+	/* The kernel names the node relative to /dev, udev does not */
+	if (strrchr(devname, '/'))
+		devname = strrchr(devname, '/') + 1;
+
+	if (!strcmp(action, "remove")) {
+		snprintf(node, sizeof(node), "/dev/%s", devname);
+		event = Py_BuildValue("{s:s}", "path", node);
+	} else {
+		event = device_info(devname);
+		if (event == Py_None) {
+			Py_DECREF(event);
+			snprintf(node, sizeof(node), "/dev/%s", devname);
+			event = Py_BuildValue("{s:s}", "path", node);
+		}
+	}
+
+	if (event && dict_set_steal(event, "action",
+				    PyUnicode_FromString(action)))
+		Py_CLEAR(event);
+
+	return event;
+}
+
+LOCKED_NOARGS(hotplug_monitor_fileno, hotplug_monitor);
+LOCKED_NOARGS(hotplug_monitor_close, hotplug_monitor);
+LOCKED_NOARGS(hotplug_monitor_read, hotplug_monitor);
+
+static PyMethodDef hotplug_monitor_methods[] = {
 	{
-		"queue_all_buffers",
-		(PyCFunction)video_device_queue_all_buffers,
+		"fileno", (PyCFunction)hotplug_monitor_fileno_locked,
 		METH_NOARGS,
-		"queue_all_buffers()\n\n"
-		"Let the video device fill all buffers created."
+		"fileno() -> integer \"file descriptor\"\n\n"
+		"Returns the file descriptor of the event socket, readable "
+		"when events are pending, e.g. for select or asyncio."
 	},
 	{
-		"read", (PyCFunction)video_device_read, METH_NOARGS,
-		"read() -> string\n\n"
-		"Reads image data from a buffer that has been filled by the "
-		"video device. The image data is in RGB och YUV420 format as "
-		"decided by 'set_format'. The buffer is removed from the "
-		"queue. Fails if no buffer is filled. Use select.select to "
-		"check for filled buffers."
+		"read", (PyCFunction)hotplug_monitor_read_locked, METH_NOARGS,
+		"read() -> dict or None\n\n"
+		"Returns the next video4linux event, None if none is pending. "
+		"'action' is e.g. 'add' or 'remove' and 'path' the device "
+		"node; other events carry the fields of list_devices."
 	},
 	{
-		"read_and_queue", (PyCFunction)video_device_read_and_queue,
+		"close", (PyCFunction)hotplug_monitor_close_locked,
 		METH_NOARGS,
-		"read_and_queue()\n\n"
-		"Same as 'read', but adds the buffer back to the queue so "
-		"the video device can fill it again."
+		"close()\n\n"
+		"Close the event socket."
 	},
 	{
 		NULL
 	}
 };
 
-static PyTypeObject video_device_type = {
-	PYOBJECT_HEAD_INIT(NULL, 0)
-	.tp_name = "V4L2VideoDevice",
-	.tp_basicsize = sizeof(video_device),
-	.tp_dealloc = (destructor)video_device_dealloc,
-	.tp_flags = Py_TPFLAGS_DEFAULT,
-	.tp_doc = "video_device(path)\n\nOpens the video device at "
-	"the given path and returns an object that can capture images. The "
-	"constructor and all methods except close may raise IOError.",
-	.tp_methods = video_device_methods,
-	.tp_init = (initproc)video_device_init
+static PyType_Slot hotplug_monitor_slots[] = {
+	{Py_tp_dealloc, hotplug_monitor_dealloc},
+	{Py_tp_doc, "V4L2HotplugMonitor(udev=True)\n\nListens to video4linux "
+	 "devices being added or removed. With 'udev', events come from "
+	 "udev once the device node is set up, otherwise straight from the "
+	 "kernel (e.g. in containers without udev)."},
+	{Py_tp_methods, hotplug_monitor_methods},
+	{Py_tp_init, hotplug_monitor_init},
+	{Py_tp_new, hotplug_monitor_new},
+	{0, NULL}
+};
+
+static PyType_Spec hotplug_monitor_spec = {
+	.name = "pyv4l2.V4L2HotplugMonitor",
+	.basicsize = sizeof(hotplug_monitor),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = hotplug_monitor_slots
 };
 
 static void video_device_members_add(PyObject *module)
@@ -977,6 +8932,7 @@ static void video_device_members_add(PyObject *module)
 	PyModule_AddIntMacro(module, V4L2_CAP_RDS_OUTPUT);
 	PyModule_AddIntMacro(module, V4L2_CAP_VIDEO_CAPTURE_MPLANE);
 	PyModule_AddIntMacro(module, V4L2_CAP_VIDEO_OUTPUT_MPLANE);
+	PyModule_AddIntMacro(module, V4L2_CAP_VIDEO_M2M);
 	PyModule_AddIntMacro(module, V4L2_CAP_TUNER);
 	PyModule_AddIntMacro(module, V4L2_CAP_AUDIO);
 	PyModule_AddIntMacro(module, V4L2_CAP_RADIO);
@@ -989,35 +8945,136 @@ static void video_device_members_add(PyObject *module)
 	PyModule_AddIntMacro(module, V4L2_FRMSIZE_TYPE_STEPWISE);
 
 	PyModule_AddIntMacro(module, V4L2_MODE_HIGHQUALITY);
+
+	PyModule_AddIntMacro(module, SCHED_OTHER);
+	PyModule_AddIntMacro(module, SCHED_FIFO);
+	PyModule_AddIntMacro(module, SCHED_RR);
+
+	PyModule_AddIntMacro(module, SCALE_BOX);
+	PyModule_AddIntMacro(module, SCALE_BILINEAR);
+
+	PyModule_AddIntMacro(module, DEMOSAIC_NONE);
+	PyModule_AddIntMacro(module, DEMOSAIC_BILINEAR);
+	PyModule_AddIntMacro(module, DEMOSAIC_EDGE);
+
+	PyModule_AddIntMacro(module, V4L2_MEMORY_MMAP);
+	PyModule_AddIntMacro(module, V4L2_MEMORY_DMABUF);
 }
 
 static PyMethodDef module_methods[] = {
+	{
+		"list_devices", (PyCFunction)list_devices,
+		METH_VARARGS | METH_KEYWORDS,
+		"list_devices(capture_only=True) -> list of dict{'path', "
+		"'name', 'index', 'capabilities', 'capture', 'sysfs', "
+		"'bus_info', 'serial', 'vendor_id', 'product_id'}\n\n"
+		"Lists the video4linux devices from sysfs and the udev "
+		"database, without opening them (unless udev does not know "
+		"them). 'bus_info' is the one VIDIOC_QUERYCAP reports, it and "
+		"'serial' identify a camera across reboots and replugs. "
+		"'capabilities' are udev's, e.g. ['capture'], None if unknown. "
+		"With 'capture_only', metadata and output nodes are left out."
+	},
 	{NULL}
 };
 
-PyMODINIT_FUNC INIT_V4L2_WRAPPER(void)
+static int module_add_type(PyObject *module, PyType_Spec *spec,
+			   PyTypeObject *base, PyTypeObject **type)
 {
-	PyObject *module = Py_None;
+	*type = (PyTypeObject *)PyType_FromModuleAndSpec(module, spec,
+							 (PyObject *)base);
+	if (!*type)
+		return -1;
 
-	Py_Initialize();
+	return PyModule_AddType(module, *type);
+}
 
-	video_device_type.tp_new = PyType_GenericNew;
+static int module_exec(PyObject *module)
+{
+	module_state *state = PyModule_GetState(module);
+
+	if (module_add_type(module, &video_device_spec, NULL,
+			    &state->video_device_type) ||
+	    module_add_type(module, &replay_device_spec,
+			    state->video_device_type,
+			    &state->replay_device_type) ||
+	    module_add_type(module, &m2m_device_spec, NULL,
+			    &state->m2m_device_type) ||
+	    module_add_type(module, &frame_subscriber_spec, NULL,
+			    &state->frame_subscriber_type) ||
+	    module_add_type(module, &shared_frame_spec, NULL,
+			    &state->shared_frame_type) ||
+	    module_add_type(module, &snapshot_future_spec, NULL,
+			    &state->snapshot_future_type) ||
+	    module_add_type(module, &hotplug_monitor_spec, NULL,
+			    &state->hotplug_monitor_type))
+		return -1;
 
-	if (PyType_Ready(&video_device_type) < 0)
-		return PYMODINIT_FUNC_RETURN(NULL);
+	video_device_members_add(module);
+	return 0;
+}
 
-	module = Py_InitModule3("pyv4l2", module_methods,
-				"Video with video4linux2.");
+static int module_traverse(PyObject *module, visitproc visit, void *arg)
+{
+	module_state *state = PyModule_GetState(module);
+
+	Py_VISIT(state->video_device_type);
+	Py_VISIT(state->replay_device_type);
+	Py_VISIT(state->m2m_device_type);
+	Py_VISIT(state->frame_subscriber_type);
+	Py_VISIT(state->shared_frame_type);
+	Py_VISIT(state->snapshot_future_type);
+	Py_VISIT(state->hotplug_monitor_type);
+	return 0;
+}
 
-	if (!module)
-		return PYMODINIT_FUNC_RETURN(NULL);
+static int module_clear(PyObject *module)
+{
+	module_state *state = PyModule_GetState(module);
+
+	Py_CLEAR(state->video_device_type);
+	Py_CLEAR(state->replay_device_type);
+	Py_CLEAR(state->m2m_device_type);
+	Py_CLEAR(state->frame_subscriber_type);
+	Py_CLEAR(state->shared_frame_type);
+	Py_CLEAR(state->snapshot_future_type);
+	Py_CLEAR(state->hotplug_monitor_type);
+	return 0;
+}
 
-	Py_INCREF(&video_device_type);
+static void module_free(void *module)
+{
+	module_clear(module);
+}
 
-	PyModule_AddObject(module, "V4L2VideoDevice",
-			   (PyObject *)&video_device_type);
+/*
+ * The module keeps no global state: every interpreter gets its own types,
+ * and the objects lock themselves when the GIL is disabled.
+ */
+static PyModuleDef_Slot module_slots[] = {
+	{Py_mod_exec, module_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+	{Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+	{Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+	{0, NULL}
+};
 
-	video_device_members_add(module);
+static struct PyModuleDef module_def = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "pyv4l2",
+	.m_doc = "Video with video4linux2.",
+	.m_size = sizeof(module_state),
+	.m_methods = module_methods,
+	.m_slots = module_slots,
+	.m_traverse = module_traverse,
+	.m_clear = module_clear,
+	.m_free = module_free,
+};
 
-	return PYMODINIT_FUNC_RETURN(module);
+PyMODINIT_FUNC PyInit_pyv4l2(void)
+{
+	return PyModuleDef_Init(&module_def);
 }
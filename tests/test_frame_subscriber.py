@@ -0,0 +1,60 @@
+#! /usr/bin/python
+#
+# Frame rings are mapped from another process: a damaged or hostile header
+# must be refused before any slot is read.
+#
+# Run from a build tree: python -m unittest discover tests
+
+import os
+import struct
+import tempfile
+import unittest
+
+import pyv4l2
+
+MAGIC = 0x324c3456
+VERSION = 1
+SLOT_HEADER = 64
+PAGE = 4096
+
+
+def ring_header(slot_count=4, slot_size=PAGE - SLOT_HEADER,
+                slot_stride=PAGE, data_offset=PAGE, magic=MAGIC):
+    return struct.pack("<IIIIQQQQ", magic, VERSION, slot_count, 0,
+                       slot_size, slot_stride, data_offset, 0)
+
+
+class FrameSubscriberTest(unittest.TestCase):
+    def open_ring(self, header, size):
+        with tempfile.NamedTemporaryFile() as ring:
+            ring.write(header)
+            ring.truncate(size)
+            ring.flush()
+            return pyv4l2.V4L2FrameSubscriber(ring.name)
+
+    def test_valid(self):
+        sub = self.open_ring(ring_header(), 5 * PAGE)
+        self.assertEqual(sub.get_info()["slots"], 4)
+        self.assertIsNone(sub.read())
+
+    def test_truncated(self):
+        with self.assertRaises(ValueError):
+            self.open_ring(ring_header(), 3 * PAGE)
+        with self.assertRaises(ValueError):
+            self.open_ring(ring_header()[:16], 16)
+
+    def test_corrupted(self):
+        for header in (ring_header(magic=0),
+                       ring_header(slot_count=0),
+                       ring_header(data_offset=0),
+                       ring_header(data_offset=1 << 62),
+                       ring_header(slot_stride=SLOT_HEADER - 8),
+                       ring_header(slot_size=PAGE),
+                       ring_header(slot_count=0xffffffff,
+                                   slot_stride=1 << 40)):
+            with self.assertRaises(ValueError):
+                self.open_ring(header, 5 * PAGE)
+
+
+if __name__ == "__main__":
+    unittest.main()